@@ -1,9 +1,16 @@
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/conn.h>
 #include <bluetooth/gatt.h>
+#include <bluetooth/hci.h>
 #include <bluetooth/uuid.h>
+#include <net/buf.h>
 #include <settings/settings.h>
+#include <sys/byteorder.h>
+#include <sys/crc.h>
 #include <sys/util.h>
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
 
 #include "main.h"
 
@@ -11,59 +18,456 @@
 LOG_MODULE_REGISTER(main_bt, LOG_LEVEL_DBG);
 
 static void start_scan(void);
+static void scan_stop(void);
+static void scan_fast(void);
+static void ccc_fallback_work_handler(struct k_work *work);
+static void poll_end_work_handler(struct k_work *work);
+static void snapshot_read(struct conninfo *conninfo);
+static void snapshot_retry_work_handler(struct k_work *work);
+
+enum conninfo_state {
+	/* bt_conn_le_create() issued, waiting for connected() */
+	CONNINFO_STATE_CONNECTING,
+	/* link is up, waiting for security_changed() */
+	CONNINFO_STATE_ENCRYPTING,
+	/* checking the database hash, discovering and subscribing */
+	CONNINFO_STATE_DISCOVERING,
+	/* all notifiable characteristics are subscribed */
+	CONNINFO_STATE_READY,
+	/* given up on during the setup, waiting for disconnected() */
+	CONNINFO_STATE_DISCONNECTING,
+};
+
+enum scan_mode {
+	SCAN_MODE_OFF,
+	/* right after a device got lost, so it's back quickly */
+	SCAN_MODE_FAST,
+	/* low duty cycle, leaves the radio to the connections */
+	SCAN_MODE_SLOW,
+};
+
+/* scan interval and window are in units of 0.625 ms */
+#define SCAN_UNITS(ms) ((ms)*8 / 5)
+
+static const struct {
+	uint16_t interval;
+	uint16_t window;
+} scan_timing[] = {
+	[SCAN_MODE_OFF] = { 1, 0 },
+	[SCAN_MODE_FAST] = { BT_GAP_SCAN_FAST_INTERVAL, BT_GAP_SCAN_FAST_WINDOW },
+	[SCAN_MODE_SLOW] = { SCAN_UNITS(CONFIG_CENTRAL_SCAN_SLOW_INTERVAL),
+			     SCAN_UNITS(CONFIG_CENTRAL_SCAN_SLOW_WINDOW) },
+};
+
+BUILD_ASSERT(CONFIG_CENTRAL_POLL_SLOTS < CONFIG_BT_MAX_CONN,
+	     "polled devices must leave slots for the others");
+
+/* how often the end of a poll is retried while requests are pending */
+#define POLL_BUSY_RETRY_MS 200
+
+/* ATT requests time out after 30s, a queued request completes or fails before that */
+#define GATT_REQ_ALLOC_TIMEOUT K_SECONDS(30)
+
+/* snapshot reads without a free request buffer are retried after 100, 200, ... 1600 ms */
+#define SNAPSHOT_RETRY_DELAY_MS 100
+#define SNAPSHOT_RETRY_MAX 5
+
+enum gatt_req_type {
+	GATT_REQ_WRITE,
+	/* write command, doesn't wait for a response */
+	GATT_REQ_WRITE_CMD,
+	/* long reads continue with read blob requests automatically */
+	GATT_REQ_READ,
+};
+
+struct gatt_req {
+	sys_snode_t node;
+	enum gatt_req_type type;
+	uint16_t handle;
+	uint16_t len;
+	/* part of a write batch */
+	bool batch;
+	/* the next request belongs to the same batch, it's dropped if this one fails */
+	bool batch_more;
+	uint8_t data[CONFIG_CENTRAL_GATT_WRITE_MAX_LEN];
+};
+
+/* the last value seen of a characteristic, from a notification or a read */
+struct value_cache_entry {
+	int64_t time;
+	/* 0 if unused */
+	uint16_t handle;
+	uint16_t len;
+	uint8_t data[CONFIG_CENTRAL_EVENT_MAX_LEN];
+};
+
+/* shared by all connections, running out of it blocks the MQTT thread */
+K_MEM_SLAB_DEFINE(gatt_req_slab, sizeof(struct gatt_req), CONFIG_CENTRAL_GATT_WRITE_POOL_SIZE, 4);
 
 struct conninfo {
 	struct bt_conn *conn;
-
-	struct bt_gatt_write_params write_params[5];
-	uint8_t gatt_write_buf[5];
+	/* key in conn_addr_map */
+	bt_addr_le_t addr;
+	struct main_peer *peer;
+	enum conninfo_state state;
+	int64_t create_time;
+
+	/* a polled device, disconnected again after CONFIG_CENTRAL_POLL_LINGER */
+	bool polled;
+	struct k_work_delayable poll_end_work;
+
+	struct bt_gatt_exchange_params mtu_params;
+	/* negotiated ATT MTU and LE data length in octets */
+	uint16_t mtu;
+	uint16_t tx_len;
+	uint16_t rx_len;
+
+	/* connections are created on Coded S8 */
+	enum main_phy phy;
+	/* requested with bt_conn_le_phy_update(), valid while phy_pending is set */
+	enum main_phy phy_target;
+	bool phy_pending;
+	/* uptime of the last PHY change */
+	int64_t phy_since;
+	/* 4 times the averaged RSSI in dBm, 0 before the first sample */
+	int16_t rssi_avg4;
+
+	sys_slist_t req_queue;
+	/* the head of req_queue is in flight */
+	bool req_busy;
+	struct bt_gatt_write_params write_params;
+	struct bt_gatt_read_params value_read_params;
+	uint8_t read_buf[CONFIG_CENTRAL_EVENT_MAX_LEN];
+	uint16_t read_len;
+	/* batched writes waiting for a flush */
+	sys_slist_t batch_queue;
+
+	struct value_cache_entry value_cache[CONFIG_CENTRAL_VALUE_CACHE_SIZE];
+
+	/* initial values of all subscribed characteristics, read in one go */
+	struct bt_gatt_read_params snapshot_params;
+	uint16_t snapshot_handles[CONFIG_CENTRAL_GATT_MAX_CHRCS];
+	size_t snapshot_count;
+	/* index into snapshot_handles of the next value in the response */
+	size_t snapshot_pos;
+	/* the read multiple request is pending */
+	bool snapshot_busy;
+	/* queues the reads from snapshot_retry_pos on once request buffers are free */
+	struct k_work_delayable snapshot_retry_work;
+	size_t snapshot_retry_pos;
+	uint8_t snapshot_retries;
+
+	struct bt_gatt_read_params read_params;
+	uint8_t db_hash[16];
+	bool db_hash_valid;
 
 	struct bt_gatt_discover_params discover_params;
-	uint16_t value_handle;
+	/* index into peer->gatt.chrcs of the CCC we're looking for */
+	size_t discover_chrc;
+	bool discover_incomplete;
+	/* declaration of the first characteristic which didn't fit, if incomplete */
+	uint16_t discover_skipped_handle;
 	struct bt_uuid_16 uuid;
 
-	struct bt_gatt_subscribe_params sub_params[10];
+	struct bt_gatt_subscribe_params sub_params[CONFIG_CENTRAL_GATT_MAX_CHRCS];
+	/* MQTT topic parts, so publishing doesn't have to format them */
+	char topic_prefix[MAIN_TOPIC_PREFIX_LEN + 1];
+	char topic_suffix[CONFIG_CENTRAL_GATT_MAX_CHRCS][MAIN_TOPIC_SUFFIX_LEN + 1];
+	/*
+	 * Set by the first notification or read value after subscribing. Devices
+	 * which rarely change might not notify in time, a read shows they answer.
+	 */
+	bool notified;
+
+	/* writes the CCCs if the peer didn't keep them */
+	struct k_work_delayable ccc_fallback_work;
+	struct bt_gatt_write_params ccc_write_params;
+	/* index into peer->gatt.chrcs of the CCC being written */
+	size_t ccc_write_chrc;
+	uint8_t ccc_write_buf[2];
 };
 
+/* indexed by bt_conn_index() */
 static struct conninfo conns[CONFIG_BT_MAX_CONN];
+/*
+ * The address map and value caches are written by the BT thread and read by
+ * the MQTT thread, the request queues are changed by both.
+ */
+static struct k_spinlock conninfo_lock;
+static size_t num_conns;
+
+/* open addressing with linear probing, at least half of it is always empty */
+#define CONN_ADDR_MAP_SIZE (2 * CONFIG_BT_MAX_CONN)
+static struct conninfo *conn_addr_map[CONN_ADDR_MAP_SIZE];
+
+/* the connection bt_conn_le_create() is pending for, the controller has one initiator only */
+static struct bt_conn *creating;
+/* uptime at which we started waiting for all bonded devices, -1 when all are connected */
+static int64_t pipeline_start = -1;
+static int64_t pipeline_last_duration = -1;
+
+static struct k_work_delayable bond_sync_work;
+/* changes whenever a bond gets added or removed */
+static uint32_t bonds_checksum;
+/* the controller only reports bonded devices to us */
+static bool whitelist_active;
+
+static enum scan_mode scan_mode;
+static int64_t scan_mode_since;
+/* milliseconds spent in every scan mode, without the current one */
+static int64_t scan_mode_time[ARRAY_SIZE(scan_timing)];
+static int64_t scan_fast_until;
+/* switches from fast to slow scanning */
+static struct k_work_delayable scan_work;
+/* starts scanning when the next polled device is due */
+static struct k_work_delayable poll_work;
+
+#ifdef CONFIG_CENTRAL_PHY_ADAPT
+/* samples the RSSI of all connections */
+static struct k_work_delayable phy_work;
+#endif
+
+static const struct {
+	const char *name;
+	struct bt_conn_le_phy_param param;
+	/* averaged RSSI in dBm from which on the next faster PHY is used */
+	int8_t rssi_up;
+} link_phys[] = {
+	[MAIN_PHY_CODED_S8] = { "coded s8",
+				{ BT_CONN_LE_PHY_OPT_CODED_S8, BT_GAP_LE_PHY_CODED,
+				  BT_GAP_LE_PHY_CODED },
+				-85 },
+	[MAIN_PHY_CODED_S2] = { "coded s2",
+				{ BT_CONN_LE_PHY_OPT_CODED_S2, BT_GAP_LE_PHY_CODED,
+				  BT_GAP_LE_PHY_CODED },
+				-78 },
+	[MAIN_PHY_1M] = { "1m",
+			  { BT_CONN_LE_PHY_OPT_NONE, BT_GAP_LE_PHY_1M, BT_GAP_LE_PHY_1M },
+			  -70 },
+	[MAIN_PHY_2M] = { "2m",
+			  { BT_CONN_LE_PHY_OPT_NONE, BT_GAP_LE_PHY_2M, BT_GAP_LE_PHY_2M },
+			  INT8_MAX },
+};
 
-static struct conninfo *conninfo_new(void)
+static size_t conn_addr_hash(const bt_addr_le_t *addr)
 {
-	size_t i;
+	// the lower bytes of random addresses are random already
+	return sys_get_le32(&addr->a.val[0]) % ARRAY_SIZE(conn_addr_map);
+}
 
-	for (i = 0; i < ARRAY_SIZE(conns); i++) {
-		if (!conns[i].conn) {
-			return &conns[i];
+/* returns the slot holding addr or the empty slot where it belongs */
+static size_t conn_addr_map_slot(const bt_addr_le_t *addr)
+{
+	size_t i = conn_addr_hash(addr);
+
+	while (conn_addr_map[i] && bt_addr_le_cmp(&conn_addr_map[i]->addr, addr)) {
+		i = (i + 1) % ARRAY_SIZE(conn_addr_map);
+	}
+
+	return i;
+}
+
+static void conn_addr_map_insert(struct conninfo *ci)
+{
+	conn_addr_map[conn_addr_map_slot(&ci->addr)] = ci;
+}
+
+static void conn_addr_map_remove(struct conninfo *ci)
+{
+	size_t i = conn_addr_map_slot(&ci->addr);
+	size_t j = i;
+	size_t k;
+
+	if (conn_addr_map[i] != ci) {
+		return;
+	}
+
+	conn_addr_map[i] = NULL;
+
+	// move entries back which can't be found anymore because of the new hole
+	for (;;) {
+		j = (j + 1) % ARRAY_SIZE(conn_addr_map);
+		if (!conn_addr_map[j]) {
+			break;
+		}
+
+		k = conn_addr_hash(&conn_addr_map[j]->addr);
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+			continue;
 		}
+
+		conn_addr_map[i] = conn_addr_map[j];
+		conn_addr_map[j] = NULL;
+		i = j;
 	}
+}
 
-	return NULL;
+static struct conninfo *conninfo_new(struct bt_conn *conn, const bt_addr_le_t *addr)
+{
+	struct conninfo *ci = &conns[bt_conn_index(conn)];
+	k_spinlock_key_t key;
+
+	memset(ci, 0, sizeof(*ci));
+	ci->conn = conn;
+	bt_addr_le_copy(&ci->addr, addr);
+
+	key = k_spin_lock(&conninfo_lock);
+	conn_addr_map_insert(ci);
+	k_spin_unlock(&conninfo_lock, key);
+	num_conns++;
+
+	return ci;
+}
+
+/* with conninfo_lock held */
+static void req_list_flush(sys_slist_t *list)
+{
+	sys_snode_t *node;
+
+	while ((node = sys_slist_get(list))) {
+		k_mem_slab_free(&gatt_req_slab, (void **)&node);
+	}
 }
 
 static void conninfo_free(struct conninfo *ci)
 {
+	struct k_work_sync sync;
+	k_spinlock_key_t key;
+
+	// the handlers must be done with the slot before it's cleared
+	k_work_cancel_delayable_sync(&ci->ccc_fallback_work, &sync);
+	k_work_cancel_delayable_sync(&ci->poll_end_work, &sync);
+	k_work_cancel_delayable_sync(&ci->snapshot_retry_work, &sync);
+
+	key = k_spin_lock(&conninfo_lock);
+	req_list_flush(&ci->req_queue);
+	req_list_flush(&ci->batch_queue);
+	conn_addr_map_remove(ci);
+	num_conns--;
+
 	memset(ci, 0, sizeof(*ci));
+	k_spin_unlock(&conninfo_lock, key);
 }
 
 static struct conninfo *conninfo_find(struct bt_conn *conn)
+{
+	struct conninfo *ci = &conns[bt_conn_index(conn)];
+
+	return ci->conn == conn ? ci : NULL;
+}
+
+static struct conninfo *conninfo_find_addr(const bt_addr_le_t *addr)
+{
+	return conn_addr_map[conn_addr_map_slot(addr)];
+}
+
+/*
+ * The connection of a peer for callers outside the BT thread. The
+ * reference in conn keeps the connection object from being reused
+ * while they wait, the caller has to drop it.
+ */
+static struct conninfo *conninfo_lookup(const bt_addr_le_t *peer, struct bt_conn **conn)
+{
+	struct conninfo *conninfo;
+
+	*conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, peer);
+	if (!*conn) {
+		return NULL;
+	}
+
+	conninfo = conninfo_find(*conn);
+	if (!conninfo) {
+		bt_conn_unref(*conn);
+		*conn = NULL;
+	}
+
+	return conninfo;
+}
+
+/* the peer's identity address might differ from the one we connected to */
+static void conninfo_update_addr(struct conninfo *ci)
+{
+	const bt_addr_le_t *dst = bt_conn_get_dst(ci->conn);
+	k_spinlock_key_t key;
+
+	if (!bt_addr_le_cmp(&ci->addr, dst)) {
+		return;
+	}
+
+	key = k_spin_lock(&conninfo_lock);
+	conn_addr_map_remove(ci);
+	bt_addr_le_copy(&ci->addr, dst);
+	conn_addr_map_insert(ci);
+	k_spin_unlock(&conninfo_lock, key);
+
+	main_mqtt_topic_prefix(&dst->a, ci->topic_prefix);
+}
+
+static struct value_cache_entry *value_cache_find(struct conninfo *ci, uint16_t handle)
 {
 	size_t i;
 
-	for (i = 0; i < ARRAY_SIZE(conns); i++) {
-		if (conns[i].conn == conn) {
-			return &conns[i];
+	for (i = 0; i < ARRAY_SIZE(ci->value_cache); i++) {
+		if (ci->value_cache[i].handle == handle) {
+			return &ci->value_cache[i];
 		}
 	}
 
 	return NULL;
 }
 
+static void value_cache_invalidate(struct conninfo *ci, uint16_t handle)
+{
+	struct value_cache_entry *entry = value_cache_find(ci, handle);
+
+	if (entry) {
+		entry->handle = 0;
+	}
+}
+
+/* replaces the oldest entry if the handle isn't cached yet */
+static void value_cache_put(struct conninfo *ci, uint16_t handle, const void *data, size_t len)
+{
+	struct value_cache_entry *entry;
+	k_spinlock_key_t key;
+	size_t i;
+
+	if (!ARRAY_SIZE(ci->value_cache)) {
+		return;
+	}
+
+	key = k_spin_lock(&conninfo_lock);
+
+	if (len > sizeof(entry->data)) {
+		value_cache_invalidate(ci, handle);
+		goto unlock;
+	}
+
+	entry = value_cache_find(ci, handle);
+	if (!entry) {
+		entry = &ci->value_cache[0];
+		for (i = 1; i < ARRAY_SIZE(ci->value_cache) && entry->handle; i++) {
+			if (!ci->value_cache[i].handle || ci->value_cache[i].time < entry->time) {
+				entry = &ci->value_cache[i];
+			}
+		}
+	}
+
+	entry->time = k_uptime_get();
+	entry->handle = handle;
+	entry->len = len;
+	memcpy(entry->data, data, len);
+
+unlock:
+	k_spin_unlock(&conninfo_lock, key);
+}
+
 static uint8_t notify_func(struct bt_conn *conn,
 			   struct bt_gatt_subscribe_params *params,
 			   const void *data,
 			   uint16_t length)
 {
-	char addr[BT_ADDR_STR_LEN];
+	struct conninfo *conninfo;
 	int rc;
 
 	if (!data) {
@@ -72,11 +476,21 @@ static uint8_t notify_func(struct bt_conn *conn,
 		return BT_GATT_ITER_STOP;
 	}
 
-	bt_addr_to_str(&bt_conn_get_dst(conn)->a, addr, sizeof(addr));
+	conninfo = conninfo_find(conn);
+	if (conninfo) {
+		conninfo->notified = true;
+		value_cache_put(conninfo, params->value_handle, data, length);
+	}
 
-	rc = main_publish_characteristic_value(addr, params->value_handle, data, length);
+	rc = main_event_post_characteristic_value(&bt_conn_get_dst(conn)->a,
+						  params->value_handle,
+						  conninfo ? params - conninfo->sub_params :
+							     MAIN_EVENT_CHRC_UNKNOWN,
+						  data,
+						  length,
+						  false);
 	if (rc) {
-		LOG_ERR("failed to publish characteristic value: %d", rc);
+		LOG_ERR("failed to queue characteristic value: %d", rc);
 	}
 
 	return BT_GATT_ITER_CONTINUE;
@@ -96,377 +510,2165 @@ static void has_bond_cb(const struct bt_bond_info *info, void *ctx_)
 	}
 }
 
-static void
-device_found(const bt_addr_le_t *addr, int8_t rssi, uint8_t type, struct net_buf_simple *ad)
+bool main_bt_is_bonded(const bt_addr_le_t *addr)
 {
-	int err;
-	char saddr[BT_ADDR_LE_STR_LEN];
-	struct bt_conn_le_create_param *conn_params;
-	struct conninfo *conninfo;
 	struct hasbond_ctx hasbond_ctx = {
 		.found = false,
 		.needle = addr,
 	};
 
-	// filter for bonded devices
 	bt_foreach_bond(BT_ID_DEFAULT, has_bond_cb, &hasbond_ctx);
-	if (!hasbond_ctx.found) {
-		LOG_INF("not bonded");
-		return;
-	}
 
-	bt_addr_le_to_str(addr, saddr, sizeof(saddr));
-	LOG_INF("[DEVICE]: %s, AD evt type %u, AD data len %u, RSSI %i",
-		log_strdup(saddr),
-		type,
-		ad->len,
-		rssi);
+	return hasbond_ctx.found;
+}
 
-	err = bt_le_scan_stop();
-	if (err) {
-		LOG_ERR("Stop LE scan failed (err %d)", err);
-	}
+/* connected or being connected */
+bool main_bt_is_connecting(const bt_addr_le_t *addr)
+{
+	return conninfo_find_addr(addr) != NULL;
+}
 
-	conninfo = conninfo_new();
-	if (!conninfo) {
-		LOG_ERR("failed to allocate conninfo");
-		// apparently we're out of memory, don't restart scanning again.
-		return;
+/*
+ * The cached topic parts of a connection. Called from the MQTT thread, which
+ * like the BT RX thread is cooperative, so the strings can't change while
+ * they're being copied.
+ */
+bool main_bt_topic_cache(const bt_addr_t *addr,
+			 uint8_t chrc,
+			 uint16_t handle,
+			 const char **prefix,
+			 const char **suffix)
+{
+	bt_addr_le_t peer = {
+		.type = BT_ADDR_LE_RANDOM,
+		.a = *addr,
+	};
+	struct conninfo *conninfo;
+
+	conninfo = conninfo_find_addr(&peer);
+	if (!conninfo || !conninfo->topic_prefix[0]) {
+		return false;
 	}
 
-	conn_params = BT_CONN_LE_CREATE_PARAM(BT_CONN_LE_OPT_CODED | BT_CONN_LE_OPT_NO_1M,
-					      BT_GAP_SCAN_FAST_INTERVAL,
-					      BT_GAP_SCAN_FAST_INTERVAL);
+	if (suffix) {
+		if (chrc >= ARRAY_SIZE(conninfo->sub_params) ||
+		    conninfo->sub_params[chrc].value_handle != handle ||
+		    !conninfo->topic_suffix[chrc][0]) {
+			return false;
+		}
 
-	err = bt_conn_le_create(addr, conn_params, BT_LE_CONN_PARAM_DEFAULT, &conninfo->conn);
-	if (err) {
-		LOG_ERR("Create conn failed (err %d)", err);
-		start_scan();
-		return;
+		*suffix = conninfo->topic_suffix[chrc];
 	}
 
-	LOG_INF("Connection pending");
+	*prefix = conninfo->topic_prefix;
+	return true;
 }
 
-static void start_scan(void)
+static void count_bond_cb(const struct bt_bond_info *info, void *ctx_)
 {
-	int err;
-	const struct bt_le_scan_param scan_param = {
-		.type = BT_LE_SCAN_TYPE_PASSIVE,
-		.interval = BT_GAP_SCAN_FAST_INTERVAL,
-		.window = BT_GAP_SCAN_FAST_WINDOW,
-		.options = BT_LE_SCAN_OPT_CODED | BT_LE_SCAN_OPT_NO_1M,
-	};
+	size_t *count = ctx_;
 
-	err = bt_le_scan_start(&scan_param, device_found);
-	if (err) {
-		LOG_ERR("Scanning failed to start (err %d)", err);
-		return;
-	}
+	ARG_UNUSED(info);
 
-	LOG_INF("Scanning successfully started");
+	(*count)++;
 }
 
-static uint8_t discover_func(struct bt_conn *conn,
-			     const struct bt_gatt_attr *attr,
-			     struct bt_gatt_discover_params *params)
+static size_t num_bonds(void)
 {
-	int err;
-	struct bt_gatt_chrc *gatt_chrc;
-	struct conninfo *conninfo = CONTAINER_OF(params, struct conninfo, discover_params);
+	size_t count = 0;
 
-	if (!attr) {
-		LOG_INF("Discover complete");
-		goto stop;
-	}
+	bt_foreach_bond(BT_ID_DEFAULT, count_bond_cb, &count);
 
-	LOG_INF("[ATTRIBUTE] handle %u", attr->handle);
+	return count;
+}
 
-	if (params->type == BT_GATT_DISCOVER_CHARACTERISTIC) {
-		gatt_chrc = attr->user_data;
+static void bonds_checksum_cb(const struct bt_bond_info *info, void *ctx_)
+{
+	uint32_t *checksum = ctx_;
 
-		if (!(gatt_chrc->properties & BT_GATT_CHRC_NOTIFY)) {
-			return BT_GATT_ITER_CONTINUE;
-		}
+	// order independent, so it doesn't matter in which order keys are stored
+	*checksum += crc32_ieee((const uint8_t *)&info->addr, sizeof(info->addr));
+}
 
-		memcpy(&conninfo->uuid, BT_UUID_GATT_CCC, sizeof(conninfo->uuid));
-		params->uuid = &conninfo->uuid.uuid;
-		params->start_handle = attr->handle + 2;
-		params->type = BT_GATT_DISCOVER_DESCRIPTOR;
+static uint32_t bonds_checksum_get(void)
+{
+	uint32_t checksum = num_bonds();
 
-		conninfo->value_handle = bt_gatt_attr_value_handle(attr);
+	bt_foreach_bond(BT_ID_DEFAULT, bonds_checksum_cb, &checksum);
 
-		err = bt_gatt_discover(conn, params);
-		if (err) {
-			LOG_ERR("Discover failed (err %d)", err);
-			goto stop;
-		}
+	return checksum;
+}
 
-		return BT_GATT_ITER_STOP;
+static void whitelist_add_cb(const struct bt_bond_info *info, void *ctx_)
+{
+	int *err = ctx_;
+	int rc;
+
+	if (*err) {
+		return;
 	}
 
-	if (params->type == BT_GATT_DISCOVER_DESCRIPTOR) {
-		struct bt_gatt_subscribe_params *subscribe_params = NULL;
-		for (size_t i = 0; i < ARRAY_SIZE(conninfo->sub_params); i++) {
-			if (conninfo->sub_params[i].notify == NULL) {
-				subscribe_params = &conninfo->sub_params[i];
-				break;
-			}
-		}
+	rc = bt_le_whitelist_add(&info->addr);
+	if (rc) {
+		*err = rc;
+	}
+}
 
-		if (!subscribe_params) {
-			LOG_ERR("no free subscribe params");
-			goto stop;
-		}
+static void whitelist_load(void)
+{
+	int err;
 
-		subscribe_params->value_handle = conninfo->value_handle;
-		subscribe_params->notify = notify_func;
-		subscribe_params->value = BT_GATT_CCC_NOTIFY;
-		subscribe_params->ccc_handle = attr->handle;
-		atomic_set_bit(subscribe_params->flags, BT_GATT_SUBSCRIBE_FLAG_VOLATILE);
+	whitelist_active = false;
 
-		err = bt_gatt_subscribe(conn, subscribe_params);
-		if (err && err != -EALREADY) {
-			LOG_INF("Subscribe failed (err %d)", err);
-			subscribe_params->notify = NULL;
-		} else {
-			LOG_INF("[SUBSCRIBED] to %04x", conninfo->value_handle);
-		}
+	if (!IS_ENABLED(CONFIG_CENTRAL_SCAN_WHITELIST)) {
+		return;
+	}
 
-		params->uuid = NULL;
-		params->start_handle = attr->handle + 1;
-		params->type = BT_GATT_DISCOVER_CHARACTERISTIC;
+	err = bt_le_whitelist_clear();
+	if (err) {
+		LOG_ERR("failed to clear whitelist: %d", err);
+		return;
+	}
 
-		err = bt_gatt_discover(conn, params);
-		if (err) {
-			LOG_ERR("Discover failed(err %d)", err);
-			goto stop;
-		}
+#ifdef CONFIG_BT_CTLR_WL_SIZE
+	// the controller would reject the bonds beyond its size one by one
+	if (num_bonds() > CONFIG_BT_CTLR_WL_SIZE) {
+		LOG_WRN("%zu bonds don't fit the whitelist of %d, filtering on the host",
+			num_bonds(),
+			CONFIG_BT_CTLR_WL_SIZE);
+		return;
+	}
+#endif
 
-		return BT_GATT_ITER_STOP;
+	bt_foreach_bond(BT_ID_DEFAULT, whitelist_add_cb, &err);
+	if (err) {
+		LOG_WRN("failed to add bond to whitelist (%d), filtering on the host", err);
+		bt_le_whitelist_clear();
+		return;
 	}
 
-stop:
-	memset(params, 0, sizeof(*params));
-	start_scan();
-	return BT_GATT_ITER_STOP;
+	whitelist_active = true;
+	LOG_INF("loaded %zu bonds into the whitelist", num_bonds());
 }
 
-static void connected(struct bt_conn *conn, uint8_t conn_err)
+static void bond_sync_work_handler(struct k_work *work)
 {
-	int err;
-	struct bt_conn_info info;
-	char addr[BT_ADDR_LE_STR_LEN];
-	char addr_nole[BT_ADDR_STR_LEN];
-	struct conninfo *conninfo;
+	uint32_t checksum = bonds_checksum_get();
 
-	conninfo = conninfo_find(conn);
-	if (!conninfo) {
-		LOG_ERR("connected with unknown connection");
+	ARG_UNUSED(work);
+
+	if (checksum == bonds_checksum) {
+		goto reschedule;
+	}
+
+	// the whitelist can't be changed while the controller is initiating
+	if (creating) {
+		k_work_reschedule(&bond_sync_work, K_MSEC(100));
 		return;
 	}
 
-	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
-	bt_addr_to_str(&bt_conn_get_dst(conn)->a, addr_nole, sizeof(addr_nole));
+	LOG_INF("bonds changed, resyncing");
+	bonds_checksum = checksum;
 
-	if (conn_err) {
-		LOG_ERR("Failed to connect to %s (%u)", log_strdup(addr), conn_err);
+	scan_stop();
 
-		bt_conn_unref(conn);
-		conninfo_free(conninfo);
+	main_peer_sync_bonds();
+	whitelist_load();
+	scan_fast();
 
-		start_scan();
+reschedule:
+	k_work_reschedule(&bond_sync_work, K_SECONDS(CONFIG_CENTRAL_BOND_SYNC_INTERVAL));
+}
 
-		return;
-	}
+/* polled devices come and go, they aren't counted */
+static size_t num_conns_in_state(enum conninfo_state state)
+{
+	size_t count = 0;
+	size_t i;
 
-	err = main_publish_connection_status(addr_nole, true);
-	if (err) {
-		LOG_ERR("Failed to publish connection status: %d", err);
+	for (i = 0; i < ARRAY_SIZE(conns); i++) {
+		if (conns[i].conn && !conns[i].polled && conns[i].state == state) {
+			count++;
+		}
 	}
 
-	err = bt_conn_get_info(conn, &info);
-	if (err) {
-		LOG_ERR("Failed to get connection info");
-	} else {
-		const struct bt_conn_le_phy_info *phy_info;
+	return count;
+}
 
-		phy_info = info.le.phy;
-		LOG_INF("Connected: %s, tx_phy %u, rx_phy %u",
-			log_strdup(addr),
-			phy_info->tx_phy,
-			phy_info->rx_phy);
-	}
+/* polled devices which are connected right now */
+static size_t num_polled_conns(void)
+{
+	size_t count = 0;
+	size_t i;
 
-	if (bt_conn_set_security(conn, BT_SECURITY_L2)) {
-		LOG_ERR("Failed to set security");
+	for (i = 0; i < ARRAY_SIZE(conns); i++) {
+		if (conns[i].conn && conns[i].polled) {
+			count++;
+		}
 	}
 
-	conninfo->discover_params.uuid = NULL;
-	conninfo->discover_params.func = discover_func;
-	conninfo->discover_params.start_handle = BT_ATT_FIRST_ATTTRIBUTE_HANDLE;
-	conninfo->discover_params.end_handle = BT_ATT_LAST_ATTTRIBUTE_HANDLE;
-	conninfo->discover_params.type = BT_GATT_DISCOVER_CHARACTERISTIC;
+	return count;
+}
 
-	err = bt_gatt_discover(conn, &conninfo->discover_params);
+/* bonded devices which should stay connected */
+static size_t num_permanent_bonds(void)
+{
+	size_t bonds = num_bonds();
+	size_t other = main_peer_num_polled() + main_peer_num_broadcasting();
+
+	return bonds - MIN(other, bonds);
+}
+
+/* connection slots for devices which stay connected */
+static size_t permanent_slots(void)
+{
+	if (!main_peer_num_polled()) {
+		return ARRAY_SIZE(conns);
+	}
+
+	return ARRAY_SIZE(conns) - CONFIG_CENTRAL_POLL_SLOTS;
+}
+
+/*
+ * Ignore the device for a while which doubles with every failure, so one out
+ * of range doesn't keep the only initiator busy while others wait.
+ */
+static void peer_connect_failed(const bt_addr_le_t *addr)
+{
+	struct main_peer *peer = main_peer_get(addr);
+	int64_t delay;
+
+	if (!peer) {
+		return;
+	}
+
+	if (peer->connect_failures < 16) {
+		peer->connect_failures++;
+	}
+
+	delay = MIN((int64_t)CONFIG_CENTRAL_CONN_BACKOFF_MIN << (peer->connect_failures - 1),
+		    (int64_t)CONFIG_CENTRAL_CONN_BACKOFF_MAX * MSEC_PER_SEC);
+	peer->next_connect = k_uptime_get() + delay;
+
+	LOG_INF("%u failed connection attempts, retrying in %lld ms",
+		peer->connect_failures,
+		delay);
+}
+
+static void peer_connect_succeeded(struct main_peer *peer)
+{
+	peer->connect_failures = 0;
+	peer->next_connect = 0;
+}
+
+static void pipeline_restart(void)
+{
+	if (pipeline_start < 0) {
+		pipeline_start = k_uptime_get();
+	}
+}
+
+static void pipeline_check_done(void)
+{
+	size_t bonds = num_permanent_bonds();
+
+	if (pipeline_start < 0 || bonds == 0) {
+		return;
+	}
+
+	if (num_conns_in_state(CONNINFO_STATE_READY) < MIN(bonds, permanent_slots())) {
+		return;
+	}
+
+	pipeline_last_duration = k_uptime_get() - pipeline_start;
+	pipeline_start = -1;
+
+	LOG_INF("all %zu bonded devices connected after %lld ms", bonds, pipeline_last_duration);
+}
+
+static void
+device_found(const bt_addr_le_t *addr, int8_t rssi, uint8_t type, struct net_buf_simple *ad)
+{
+	int err;
+	char saddr[BT_ADDR_LE_STR_LEN];
+	struct bt_conn_le_create_param *conn_params;
+	struct bt_conn *conn;
+	struct conninfo *conninfo;
+	struct main_peer *peer;
+	const struct main_peer *next_poll;
+
+	if (creating) {
+		return;
+	}
+
+	// filter for bonded devices, unless the controller already did that
+	if (!whitelist_active && !main_bt_is_bonded(addr)) {
+		LOG_DBG("not bonded");
+		return;
+	}
+
+	// a connection to this device is already being set up
+	if (conninfo_find_addr(addr)) {
+		return;
+	}
+
+	if (IS_ENABLED(CONFIG_CENTRAL_BROADCAST) && main_broadcast_handle(addr, ad)) {
+		return;
+	}
+
+	peer = main_peer_find(addr);
+	if (peer && k_uptime_get() < peer->next_connect) {
+		LOG_DBG("backing off");
+		return;
+	}
+
+	if (peer && peer->polled) {
+		if (k_uptime_get() < peer->poll_due ||
+		    num_polled_conns() >= CONFIG_CENTRAL_POLL_SLOTS) {
+			LOG_DBG("not due for polling");
+			return;
+		}
+
+		// any due device which advertises gets the slot, the order only breaks ties
+		peer->poll_seen = k_uptime_get();
+		next_poll = main_peer_next_poll(peer->poll_seen);
+		if (next_poll && next_poll->poll_due < peer->poll_due) {
+			LOG_DBG("another device is due first");
+			return;
+		}
+	} else if (num_conns - num_polled_conns() >= permanent_slots()) {
+		LOG_DBG("no slot left for permanent connections");
+		return;
+	}
+
+	bt_addr_le_to_str(addr, saddr, sizeof(saddr));
+	LOG_INF("[DEVICE]: %s, AD evt type %u, AD data len %u, RSSI %i",
+		log_strdup(saddr),
+		type,
+		ad->len,
+		rssi);
+
+	if (num_conns >= ARRAY_SIZE(conns)) {
+		LOG_ERR("failed to allocate conninfo");
+		return;
+	}
+
+	// the host can't initiate while scanning, so pause until connected() runs
+	scan_stop();
+
+	conn_params = BT_CONN_LE_CREATE_PARAM(BT_CONN_LE_OPT_CODED | BT_CONN_LE_OPT_NO_1M,
+					      BT_GAP_SCAN_FAST_INTERVAL,
+					      BT_GAP_SCAN_FAST_INTERVAL);
+	// in units of 10 ms, connected() gets an error when it expires
+	conn_params->timeout = CONFIG_CENTRAL_CONN_CREATE_TIMEOUT / 10;
+
+	err = bt_conn_le_create(addr, conn_params, main_peer_conn_param(peer), &conn);
+	if (err) {
+		LOG_ERR("Create conn failed (err %d)", err);
+		peer_connect_failed(addr);
+		start_scan();
+		return;
+	}
+
+	conninfo = conninfo_new(conn, addr);
+	k_work_init_delayable(&conninfo->ccc_fallback_work, ccc_fallback_work_handler);
+	k_work_init_delayable(&conninfo->poll_end_work, poll_end_work_handler);
+	k_work_init_delayable(&conninfo->snapshot_retry_work, snapshot_retry_work_handler);
+	conninfo->polled = peer && peer->polled;
+
+	creating = conn;
+	conninfo->state = CONNINFO_STATE_CONNECTING;
+	conninfo->create_time = k_uptime_get();
+
+	LOG_INF("Connection pending");
+}
+
+static void scan_mode_set(enum scan_mode mode)
+{
+	int64_t now = k_uptime_get();
+
+	scan_mode_time[scan_mode] += now - scan_mode_since;
+	scan_mode_since = now;
+	scan_mode = mode;
+}
+
+static void scan_stop(void)
+{
+	int err;
+
+	if (scan_mode == SCAN_MODE_OFF) {
+		return;
+	}
+
+	err = bt_le_scan_stop();
+	if (err && err != -EALREADY) {
+		LOG_ERR("Stop LE scan failed (err %d)", err);
+	}
+
+	scan_mode_set(SCAN_MODE_OFF);
+}
+
+/*
+ * Bonded devices which aren't connected or being connected and have a slot
+ * to go to. Polled devices count only while they're due.
+ */
+static size_t num_missing_peers(void)
+{
+	size_t polled = main_peer_num_polled();
+	size_t polled_conns = num_polled_conns();
+	size_t bonds = num_permanent_bonds();
+	size_t permanent = num_conns - polled_conns;
+	// their advertisements are all we get from them
+	size_t missing = main_peer_num_broadcasting();
+	size_t due;
+	int64_t now = k_uptime_get();
+	int64_t next_due;
+
+	if (bonds > permanent && permanent_slots() > permanent) {
+		missing += MIN(bonds - permanent, permanent_slots() - permanent);
+	}
+
+	if (!polled) {
+		return missing;
+	}
+
+	// devices stay due until their poll is complete
+	due = main_peer_num_due(now, &next_due);
+	if (due > polled_conns && polled_conns < CONFIG_CENTRAL_POLL_SLOTS) {
+		missing += MIN(due - polled_conns, CONFIG_CENTRAL_POLL_SLOTS - polled_conns);
+	}
+
+	if (next_due != INT64_MAX) {
+		k_work_reschedule(&poll_work, K_MSEC(next_due - now));
+	}
+
+	return missing;
+}
+
+static void poll_work_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	start_scan();
+}
+
+/* the device had its chance to send what it queued, let the next one in */
+static void poll_end_work_handler(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct conninfo *conninfo = CONTAINER_OF(dwork, struct conninfo, poll_end_work);
+	int err;
+
+	if (!conninfo->conn || conninfo->state != CONNINFO_STATE_READY) {
+		return;
+	}
+
+	// reads and writes from MQTT are still running
+	if (conninfo->req_busy || !sys_slist_is_empty(&conninfo->req_queue) ||
+	    conninfo->snapshot_busy ||
+	    k_work_delayable_is_pending(&conninfo->snapshot_retry_work)) {
+		k_work_schedule(&conninfo->poll_end_work, K_MSEC(POLL_BUSY_RETRY_MS));
+		return;
+	}
+
+	err = bt_conn_disconnect(conninfo->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	if (err) {
+		LOG_ERR("Failed to end poll: %d", err);
+	}
+}
+
+/* scan in the mode which fits the current situation, or not at all */
+static void start_scan(void)
+{
+	int err;
+	int64_t now = k_uptime_get();
+	enum scan_mode mode = (now < scan_fast_until) ? SCAN_MODE_FAST : SCAN_MODE_SLOW;
+	struct bt_le_scan_param scan_param = {
+		.type = BT_LE_SCAN_TYPE_PASSIVE,
+		.interval = scan_timing[mode].interval,
+		.window = scan_timing[mode].window,
+		.options = BT_LE_SCAN_OPT_CODED | BT_LE_SCAN_OPT_NO_1M,
+	};
+
+	if (whitelist_active) {
+		scan_param.options |= BT_LE_SCAN_OPT_FILTER_WHITELIST;
+	}
+
+	if (creating) {
+		// connected() restarts scanning once the pending create resolves
+		return;
+	}
+
+	if (num_conns >= ARRAY_SIZE(conns) && !main_peer_num_broadcasting()) {
+		LOG_INF("all connection slots are in use, not scanning");
+		scan_stop();
+		return;
+	}
+
+	if (!num_missing_peers()) {
+		if (scan_mode != SCAN_MODE_OFF) {
+			LOG_INF("all bonded devices are connected, not scanning");
+		}
+		scan_stop();
+		return;
+	}
+
+	// scan_fast() might have moved the end of the fast phase
+	if (mode == SCAN_MODE_FAST) {
+		k_work_reschedule(&scan_work, K_MSEC(scan_fast_until - now));
+	}
+
+	if (mode == scan_mode) {
+		return;
+	}
+
+	scan_stop();
+
+	err = bt_le_scan_start(&scan_param, device_found);
+	if (err) {
+		LOG_ERR("Scanning failed to start (err %d)", err);
+		return;
+	}
+
+	scan_mode_set(mode);
+
+	LOG_INF("Scanning successfully started (%s)", (mode == SCAN_MODE_FAST) ? "fast" : "slow");
+}
+
+/* a device went missing, look for it with a high duty cycle for a while */
+static void scan_fast(void)
+{
+	scan_fast_until = k_uptime_get() + CONFIG_CENTRAL_SCAN_FAST_DURATION * MSEC_PER_SEC;
+	start_scan();
+}
+
+static void scan_work_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	start_scan();
+}
+
+static void ccc_write_next(struct conninfo *conninfo);
+
+static void ccc_write_func(struct bt_conn *conn, uint8_t err, struct bt_gatt_write_params *params)
+{
+	struct conninfo *conninfo = CONTAINER_OF(params, struct conninfo, ccc_write_params);
+
+	if (err) {
+		LOG_ERR("CCC write to %04x failed (err 0x%02x)", params->handle, err);
+	}
+
+	if (!conninfo->conn) {
+		return;
+	}
+
+	conninfo->ccc_write_chrc++;
+	ccc_write_next(conninfo);
+}
+
+/* write the CCC of the next subscribed characteristic */
+static void ccc_write_next(struct conninfo *conninfo)
+{
+	int err;
+	struct bt_gatt_write_params *params = &conninfo->ccc_write_params;
+	const struct main_gatt_cache *gatt = &conninfo->peer->gatt;
+	const struct bt_gatt_subscribe_params *subscribe_params;
+	size_t i;
+
+	for (i = conninfo->ccc_write_chrc; i < gatt->num_chrcs; i++) {
+		if (conninfo->sub_params[i].notify) {
+			break;
+		}
+	}
+
+	conninfo->ccc_write_chrc = i;
+	if (i == gatt->num_chrcs) {
+		LOG_INF("all CCCs written");
+		return;
+	}
+
+	subscribe_params = &conninfo->sub_params[i];
+	sys_put_le16(subscribe_params->value, conninfo->ccc_write_buf);
+
+	params->func = ccc_write_func;
+	params->handle = subscribe_params->ccc_handle;
+	params->offset = 0;
+	params->data = conninfo->ccc_write_buf;
+	params->length = sizeof(conninfo->ccc_write_buf);
+
+	err = bt_gatt_write(conninfo->conn, params);
+	if (err) {
+		LOG_ERR("failed to write CCC %04x: %d", params->handle, err);
+	}
+}
+
+static void ccc_fallback_work_handler(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct conninfo *conninfo = CONTAINER_OF(dwork, struct conninfo, ccc_fallback_work);
+
+	if (!conninfo->conn || conninfo->notified) {
+		return;
+	}
+
+	LOG_WRN("no notification since reconnecting, writing CCCs");
+
+	conninfo->ccc_write_chrc = 0;
+	ccc_write_next(conninfo);
+}
+
+/* with resubscribe set the peer is expected to still have our CCC values */
+static void subscribe_all(struct conninfo *conninfo, bool resubscribe)
+{
+	int err;
+	const struct main_gatt_cache *gatt = &conninfo->peer->gatt;
+	size_t i;
+
+	for (i = 0; i < gatt->num_chrcs; i++) {
+		const struct main_gatt_chrc *chrc = &gatt->chrcs[i];
+		struct bt_gatt_subscribe_params *subscribe_params = &conninfo->sub_params[i];
+
+		if (!(chrc->properties & BT_GATT_CHRC_NOTIFY) || !chrc->ccc_handle) {
+			continue;
+		}
+
+		subscribe_params->value_handle = chrc->value_handle;
+		main_mqtt_topic_suffix(chrc->value_handle, conninfo->topic_suffix[i]);
+
+		subscribe_params->notify = notify_func;
+		subscribe_params->value = BT_GATT_CCC_NOTIFY;
+		subscribe_params->ccc_handle = chrc->ccc_handle;
+		// the params die with the connection, so the stack must not keep them
+		atomic_set_bit(subscribe_params->flags, BT_GATT_SUBSCRIBE_FLAG_VOLATILE);
+
+		if (resubscribe) {
+			err = bt_gatt_resubscribe(BT_ID_DEFAULT,
+						  bt_conn_get_dst(conninfo->conn),
+						  subscribe_params);
+		} else {
+			err = bt_gatt_subscribe(conninfo->conn, subscribe_params);
+		}
+		if (err && err != -EALREADY) {
+			LOG_INF("Subscribe failed (err %d)", err);
+			subscribe_params->notify = NULL;
+		} else {
+			LOG_INF("[%s] to %04x",
+				resubscribe ? "RESUBSCRIBED" : "SUBSCRIBED",
+				chrc->value_handle);
+		}
+	}
+
+#ifdef CONFIG_CENTRAL_GATT_PERSISTENT_CCC
+	if (resubscribe) {
+		k_work_schedule(&conninfo->ccc_fallback_work,
+				K_SECONDS(CONFIG_CENTRAL_GATT_CCC_FALLBACK_TIMEOUT));
+	}
+#endif
+
+	snapshot_read(conninfo);
+
+	peer_connect_succeeded(conninfo->peer);
+	conninfo->state = CONNINFO_STATE_READY;
+	LOG_INF("connection setup took %lld ms", k_uptime_get() - conninfo->create_time);
+	pipeline_check_done();
+
+	if (conninfo->polled) {
+		k_work_schedule(&conninfo->poll_end_work, K_MSEC(CONFIG_CENTRAL_POLL_LINGER));
+	}
+}
+
+static void discover_done(struct conninfo *conninfo, bool complete)
+{
+	struct main_peer *peer = conninfo->peer;
+	int err;
+
+	memset(&conninfo->discover_params, 0, sizeof(conninfo->discover_params));
+
+	if (complete && conninfo->db_hash_valid && IS_ENABLED(CONFIG_CENTRAL_GATT_CACHE)) {
+		memcpy(peer->gatt.db_hash, conninfo->db_hash, sizeof(peer->gatt.db_hash));
+		peer->gatt_valid = true;
+
+		err = main_peer_store_gatt(peer);
+		if (err) {
+			LOG_ERR("failed to store gatt cache: %d", err);
+		}
+	}
+
+	subscribe_all(conninfo, false);
+}
+
+/* look for the CCC of the next notifiable characteristic */
+static void discover_next_ccc(struct conninfo *conninfo)
+{
+	int err;
+	struct bt_gatt_discover_params *params = &conninfo->discover_params;
+	const struct main_gatt_cache *gatt = &conninfo->peer->gatt;
+	const struct main_gatt_chrc *chrc;
+	size_t i;
+
+	for (i = conninfo->discover_chrc; i < gatt->num_chrcs; i++) {
+		chrc = &gatt->chrcs[i];
+
+		if (chrc->properties & BT_GATT_CHRC_NOTIFY) {
+			break;
+		}
+	}
+
+	conninfo->discover_chrc = i;
+	if (i == gatt->num_chrcs) {
+		LOG_INF("Discover complete");
+		discover_done(conninfo, !conninfo->discover_incomplete);
+		return;
+	}
+
+	memcpy(&conninfo->uuid, BT_UUID_GATT_CCC, sizeof(conninfo->uuid));
+	params->uuid = &conninfo->uuid.uuid;
+	params->start_handle = chrc->value_handle + 1;
+	// descriptors end right before the declaration of the next characteristic
+	if (i + 1 < gatt->num_chrcs) {
+		params->end_handle = gatt->chrcs[i + 1].value_handle - 2;
+	} else if (conninfo->discover_incomplete) {
+		// don't run into the descriptors of characteristics we skipped
+		params->end_handle = conninfo->discover_skipped_handle - 1;
+	} else {
+		params->end_handle = BT_ATT_LAST_ATTTRIBUTE_HANDLE;
+	}
+	params->type = BT_GATT_DISCOVER_DESCRIPTOR;
+
+	err = bt_gatt_discover(conninfo->conn, params);
+	if (err) {
+		LOG_ERR("Discover failed (err %d)", err);
+		discover_done(conninfo, false);
+	}
+}
+
+static uint8_t discover_func(struct bt_conn *conn,
+			     const struct bt_gatt_attr *attr,
+			     struct bt_gatt_discover_params *params)
+{
+	struct bt_gatt_chrc *gatt_chrc;
+	struct conninfo *conninfo = CONTAINER_OF(params, struct conninfo, discover_params);
+	struct main_gatt_cache *gatt = &conninfo->peer->gatt;
+	struct main_gatt_chrc *chrc;
+
+	if (params->type == BT_GATT_DISCOVER_CHARACTERISTIC) {
+		if (!attr) {
+			conninfo->discover_chrc = 0;
+			discover_next_ccc(conninfo);
+			return BT_GATT_ITER_STOP;
+		}
+
+		LOG_INF("[ATTRIBUTE] handle %u", attr->handle);
+
+		if (gatt->num_chrcs >= ARRAY_SIZE(gatt->chrcs)) {
+			LOG_ERR("no space for characteristic %u", attr->handle);
+			if (!conninfo->discover_incomplete) {
+				conninfo->discover_skipped_handle = attr->handle;
+			}
+			conninfo->discover_incomplete = true;
+			return BT_GATT_ITER_CONTINUE;
+		}
+
+		gatt_chrc = attr->user_data;
+		chrc = &gatt->chrcs[gatt->num_chrcs++];
+		chrc->value_handle = bt_gatt_attr_value_handle(attr);
+		chrc->ccc_handle = 0;
+		chrc->properties = gatt_chrc->properties;
+
+		return BT_GATT_ITER_CONTINUE;
+	}
+
+	if (attr) {
+		gatt->chrcs[conninfo->discover_chrc].ccc_handle = attr->handle;
+	} else {
+		LOG_WRN("no CCC for %04x", gatt->chrcs[conninfo->discover_chrc].value_handle);
+	}
+
+	conninfo->discover_chrc++;
+	discover_next_ccc(conninfo);
+
+	return BT_GATT_ITER_STOP;
+}
+
+static void start_discovery(struct conninfo *conninfo)
+{
+	int err;
+	struct main_peer *peer = conninfo->peer;
+
+	peer->gatt_valid = false;
+	peer->gatt.num_chrcs = 0;
+	conninfo->discover_incomplete = false;
+
+	conninfo->discover_params.uuid = NULL;
+	conninfo->discover_params.func = discover_func;
+	conninfo->discover_params.start_handle = BT_ATT_FIRST_ATTTRIBUTE_HANDLE;
+	conninfo->discover_params.end_handle = BT_ATT_LAST_ATTTRIBUTE_HANDLE;
+	conninfo->discover_params.type = BT_GATT_DISCOVER_CHARACTERISTIC;
+
+	err = bt_gatt_discover(conninfo->conn, &conninfo->discover_params);
+	if (err) {
+		LOG_ERR("Discover failed(err %d)", err);
+		discover_done(conninfo, false);
+		return;
+	}
+}
+
+static uint8_t db_hash_read_func(struct bt_conn *conn,
+				 uint8_t err,
+				 struct bt_gatt_read_params *params,
+				 const void *data,
+				 uint16_t length)
+{
+	struct conninfo *conninfo = CONTAINER_OF(params, struct conninfo, read_params);
+	struct main_peer *peer = conninfo->peer;
+
+	if (err || !data || length != sizeof(conninfo->db_hash)) {
+		LOG_WRN("can't read database hash (err 0x%02x)", err);
+		start_discovery(conninfo);
+		return BT_GATT_ITER_STOP;
+	}
+
+	memcpy(conninfo->db_hash, data, length);
+	conninfo->db_hash_valid = true;
+
+	if (peer->gatt_valid && !memcmp(peer->gatt.db_hash, conninfo->db_hash, length)) {
+		LOG_INF("database unchanged, using %u cached characteristics",
+			peer->gatt.num_chrcs);
+		subscribe_all(conninfo, IS_ENABLED(CONFIG_CENTRAL_GATT_PERSISTENT_CCC));
+		return BT_GATT_ITER_STOP;
+	}
+
+	start_discovery(conninfo);
+	return BT_GATT_ITER_STOP;
+}
+
+static void start_gatt_setup(struct conninfo *conninfo)
+{
+	int err;
+
+	conninfo->state = CONNINFO_STATE_DISCOVERING;
+
+	if (!IS_ENABLED(CONFIG_CENTRAL_GATT_CACHE)) {
+		start_discovery(conninfo);
+		return;
+	}
+
+	// the hash tells us whether the handles we know are still valid
+	conninfo->read_params.func = db_hash_read_func;
+	conninfo->read_params.handle_count = 0;
+	conninfo->read_params.by_uuid.start_handle = BT_ATT_FIRST_ATTTRIBUTE_HANDLE;
+	conninfo->read_params.by_uuid.end_handle = BT_ATT_LAST_ATTTRIBUTE_HANDLE;
+	conninfo->read_params.by_uuid.uuid = BT_UUID_GATT_DB_HASH;
+
+	err = bt_gatt_read(conninfo->conn, &conninfo->read_params);
+	if (err) {
+		LOG_ERR("failed to read database hash: %d", err);
+		start_discovery(conninfo);
+	}
+}
+
+static void conn_param_check(struct conninfo *conninfo, const struct bt_conn_info *info)
+{
+	const struct bt_le_conn_param *param = main_peer_conn_param(conninfo->peer);
+	int err;
+
+	if (info->le.interval >= param->interval_min && info->le.interval <= param->interval_max &&
+	    info->le.latency == param->latency && info->le.timeout == param->timeout) {
+		return;
+	}
+
+	err = bt_conn_le_param_update(conninfo->conn, param);
+	if (err) {
+		LOG_ERR("Failed to update connection parameters: %d", err);
+	}
+}
+
+/* after the parameters of a device got changed from the shell */
+int main_bt_update_conn_param(const bt_addr_le_t *addr)
+{
+	struct bt_conn *conn;
+	struct conninfo *conninfo;
+	struct bt_conn_info info;
+	int err = 0;
+
+	// the shell thread holds a reference, so the slot stays ours meanwhile
+	conninfo = conninfo_lookup(addr, &conn);
+	if (!conninfo) {
+		// used for the next connection
+		return 0;
+	}
+
+	if (conninfo->state == CONNINFO_STATE_CONNECTING ||
+	    conninfo->state == CONNINFO_STATE_DISCONNECTING) {
+		goto unref_conn;
+	}
+
+	err = bt_conn_get_info(conn, &info);
+	if (err) {
+		goto unref_conn;
+	}
+
+	conn_param_check(conninfo, &info);
+
+unref_conn:
+	bt_conn_unref(conn);
+
+	return err;
+}
+
+static void mtu_exchange_func(struct bt_conn *conn,
+			      uint8_t err,
+			      struct bt_gatt_exchange_params *params)
+{
+	struct conninfo *conninfo = CONTAINER_OF(params, struct conninfo, mtu_params);
+
+	if (err) {
+		LOG_ERR("MTU exchange failed (err 0x%02x)", err);
+	}
+
+	conninfo->mtu = bt_gatt_get_mtu(conn);
+	LOG_INF("ATT MTU: %u", conninfo->mtu);
+}
+
+#ifdef CONFIG_BT_USER_DATA_LEN_UPDATE
+static void le_data_len_updated(struct bt_conn *conn, struct bt_conn_le_data_len_info *info)
+{
+	struct conninfo *conninfo = conninfo_find(conn);
+
+	LOG_INF("Data length: tx %u, rx %u", info->tx_max_len, info->rx_max_len);
+
+	if (conninfo) {
+		conninfo->tx_len = info->tx_max_len;
+		conninfo->rx_len = info->rx_max_len;
+	}
+}
+#endif
+
+#ifdef CONFIG_CENTRAL_PHY_ADAPT
+static int read_rssi(struct bt_conn *conn, int8_t *rssi)
+{
+	struct bt_hci_cp_read_rssi *cp;
+	struct bt_hci_rp_read_rssi *rp;
+	struct net_buf *buf;
+	struct net_buf *rsp = NULL;
+	uint16_t handle;
+	int err;
+
+	err = bt_hci_get_conn_handle(conn, &handle);
+	if (err) {
+		return err;
+	}
+
+	buf = bt_hci_cmd_create(BT_HCI_OP_READ_RSSI, sizeof(*cp));
+	if (!buf) {
+		return -ENOBUFS;
+	}
+
+	cp = net_buf_add(buf, sizeof(*cp));
+	cp->handle = sys_cpu_to_le16(handle);
+
+	err = bt_hci_cmd_send_sync(BT_HCI_OP_READ_RSSI, buf, &rsp);
+	if (err) {
+		return err;
+	}
+
+	rp = (void *)rsp->data;
+	*rssi = rp->rssi;
+	net_buf_unref(rsp);
+
+	return 0;
+}
+
+/* one step at a time, so a link getting worse is noticed before it's lost */
+static void phy_adapt(struct conninfo *conninfo)
+{
+	enum main_phy limit = MAIN_PHY_2M - MIN(conninfo->peer->phy_backoff, MAIN_PHY_2M);
+	enum main_phy target = conninfo->phy;
+	struct bt_conn *conn = bt_conn_ref(conninfo->conn);
+	int8_t rssi;
+	int err;
+
+	err = read_rssi(conn, &rssi);
+	if (err) {
+		LOG_WRN("Failed to read RSSI: %d", err);
+		goto unref_conn;
+	}
+
+	// the device might have disconnected while we waited for the controller
+	if (conninfo->conn != conn) {
+		goto unref_conn;
+	}
+
+	if (!conninfo->rssi_avg4) {
+		conninfo->rssi_avg4 = rssi * 4;
+	} else {
+		conninfo->rssi_avg4 += rssi - conninfo->rssi_avg4 / 4;
+	}
+
+	if (conninfo->phy_pending) {
+		goto unref_conn;
+	}
+
+	if (conninfo->phy > limit) {
+		target = conninfo->phy - 1;
+	} else if (conninfo->phy < limit &&
+		   conninfo->rssi_avg4 / 4 >= link_phys[conninfo->phy].rssi_up) {
+		target = conninfo->phy + 1;
+	} else if (conninfo->phy > MAIN_PHY_CODED_S8 &&
+		   conninfo->rssi_avg4 / 4 < link_phys[conninfo->phy - 1].rssi_up -
+						     CONFIG_CENTRAL_PHY_ADAPT_HYSTERESIS) {
+		target = conninfo->phy - 1;
+	}
+
+	if (target == conninfo->phy) {
+		goto unref_conn;
+	}
+
+	err = bt_conn_le_phy_update(conn, &link_phys[target].param);
+	if (err) {
+		LOG_ERR("Failed to update PHY: %d", err);
+		goto unref_conn;
+	}
+
+	conninfo->phy_target = target;
+	conninfo->phy_pending = true;
+
+unref_conn:
+	bt_conn_unref(conn);
+}
+
+static void phy_work_handler(struct k_work *work)
+{
+	size_t i;
+
+	ARG_UNUSED(work);
+
+	for (i = 0; i < ARRAY_SIZE(conns); i++) {
+		if (conns[i].conn && conns[i].state == CONNINFO_STATE_READY) {
+			phy_adapt(&conns[i]);
+		}
+	}
+
+	k_work_schedule(&phy_work, K_SECONDS(CONFIG_CENTRAL_PHY_ADAPT_INTERVAL));
+}
+
+static void le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *info)
+{
+	struct conninfo *conninfo = conninfo_find(conn);
+	enum main_phy phy;
+	int err;
+
+	if (!conninfo) {
+		return;
+	}
+
+	// the coding isn't reported, assume we got what we asked for
+	switch (info->tx_phy) {
+	case BT_GAP_LE_PHY_1M:
+		phy = MAIN_PHY_1M;
+		break;
+	case BT_GAP_LE_PHY_2M:
+		phy = MAIN_PHY_2M;
+		break;
+	default:
+		if (conninfo->phy_pending && conninfo->phy_target <= MAIN_PHY_CODED_S2) {
+			phy = conninfo->phy_target;
+		} else if (conninfo->phy <= MAIN_PHY_CODED_S2) {
+			// the device refused to leave the Coded PHY, the coding didn't change
+			phy = conninfo->phy;
+		} else {
+			phy = MAIN_PHY_CODED_S8;
+		}
+		break;
+	}
+
+	conninfo->phy_pending = false;
+	if (phy == conninfo->phy) {
+		return;
+	}
+
+	LOG_INF("PHY: %s, RSSI %d", link_phys[phy].name, conninfo->rssi_avg4 / 4);
+
+	conninfo->phy = phy;
+	conninfo->phy_since = k_uptime_get();
+
+	err = main_event_post_phy(&bt_conn_get_dst(conn)->a, phy);
 	if (err) {
-		LOG_ERR("Discover failed(err %d)", err);
+		LOG_ERR("Failed to queue PHY: %d", err);
+	}
+}
+#endif
+
+/* both run alongside pairing and discovery, they don't need encryption */
+static void request_larger_pdus(struct conninfo *conninfo)
+{
+	int err;
+
+	conninfo->mtu = bt_gatt_get_mtu(conninfo->conn);
+	conninfo->mtu_params.func = mtu_exchange_func;
+
+	err = bt_gatt_exchange_mtu(conninfo->conn, &conninfo->mtu_params);
+	if (err) {
+		LOG_ERR("Failed to exchange MTU: %d", err);
+	}
+
+#ifdef CONFIG_BT_USER_DATA_LEN_UPDATE
+	const struct bt_conn_le_data_len_param param = {
+		.tx_max_len = CONFIG_BT_CTLR_DATA_LENGTH_MAX,
+		.tx_max_time = BT_GAP_DATA_TIME_MAX,
+	};
+
+	err = bt_conn_le_data_len_update(conninfo->conn, &param);
+	if (err) {
+		LOG_ERR("Failed to update data length: %d", err);
+	}
+#endif
+}
+
+static void poll_started(struct main_peer *peer)
+{
+	int64_t now = k_uptime_get();
+
+	// 0 after boot or after the device got added, nobody waited for it yet
+	peer->poll_lag_last = peer->poll_due ? MAX(now - peer->poll_due, 0) : 0;
+	peer->poll_lag_max = MAX(peer->poll_lag_max, peer->poll_lag_last);
+}
+
+/* round robin, the device goes to the end of the line */
+static void poll_done(struct main_peer *peer)
+{
+	int64_t now = k_uptime_get();
+
+	peer->last_poll = now;
+	peer->polls++;
+	peer->poll_due = now + CONFIG_CENTRAL_POLL_INTERVAL * MSEC_PER_SEC;
+}
+
+static void connected(struct bt_conn *conn, uint8_t conn_err)
+{
+	int err;
+	struct bt_conn_info info;
+	char addr[BT_ADDR_LE_STR_LEN];
+	struct conninfo *conninfo;
+
+	conninfo = conninfo_find(conn);
+	if (!conninfo) {
+		LOG_ERR("connected with unknown connection");
+		return;
+	}
+
+	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+
+	if (creating == conn) {
+		creating = NULL;
+	}
+
+	if (conn_err) {
+		LOG_ERR("Failed to connect to %s (%u)", log_strdup(addr), conn_err);
+
+		peer_connect_failed(&conninfo->addr);
+		bt_conn_unref(conn);
+		conninfo_free(conninfo);
+
+		start_scan();
+
+		return;
+	}
+
+	// look for the next device while this one runs through the rest of the setup
+	start_scan();
+
+	conninfo->peer = main_peer_get(bt_conn_get_dst(conn));
+	if (!conninfo->peer) {
+		LOG_ERR("no space for peer %s", log_strdup(addr));
+		conninfo->state = CONNINFO_STATE_DISCONNECTING;
+		bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+		return;
+	}
+
+	main_mqtt_topic_prefix(&bt_conn_get_dst(conn)->a, conninfo->topic_prefix);
+
+	if (conninfo->polled) {
+		poll_started(conninfo->peer);
+	} else {
+		err = main_event_post_connection_status(&bt_conn_get_dst(conn)->a, true);
+		if (err) {
+			LOG_ERR("Failed to queue connection status: %d", err);
+		}
+	}
+
+	conninfo->phy_since = k_uptime_get();
+	err = main_event_post_phy(&bt_conn_get_dst(conn)->a, conninfo->phy);
+	if (err) {
+		LOG_ERR("Failed to queue PHY: %d", err);
+	}
+
+	err = bt_conn_get_info(conn, &info);
+	if (err) {
+		LOG_ERR("Failed to get connection info");
+	} else {
+		const struct bt_conn_le_phy_info *phy_info;
+
+		phy_info = info.le.phy;
+		LOG_INF("Connected: %s, tx_phy %u, rx_phy %u, interval %u",
+			log_strdup(addr),
+			phy_info->tx_phy,
+			phy_info->rx_phy,
+			info.le.interval);
+
+		// created with the default profile if we didn't know the address yet
+		conn_param_check(conninfo, &info);
+
+#ifdef CONFIG_BT_USER_DATA_LEN_UPDATE
+		conninfo->tx_len = info.le.data_len->tx_max_len;
+		conninfo->rx_len = info.le.data_len->rx_max_len;
+#endif
+	}
+
+	request_larger_pdus(conninfo);
+
+	conninfo->state = CONNINFO_STATE_ENCRYPTING;
+
+	err = bt_conn_set_security(conn, BT_SECURITY_L2);
+	if (err) {
+		LOG_ERR("Failed to set security: %d", err);
+		start_gatt_setup(conninfo);
+	}
+}
+
+static void security_changed(struct bt_conn *conn, bt_security_t level, enum bt_security_err err)
+{
+	struct conninfo *conninfo;
+
+	conninfo = conninfo_find(conn);
+
+	if (err) {
+		LOG_ERR("Security failed: level %u err %d", level, err);
+	} else {
+		LOG_INF("Security changed: level %u", level);
+	}
+
+	// this might have been a new bond
+	k_work_reschedule(&bond_sync_work, K_NO_WAIT);
+
+	if (conninfo) {
+		conninfo_update_addr(conninfo);
+	}
+
+	// discovery also works unencrypted, subscribing retries after elevating security
+	if (conninfo && conninfo->state == CONNINFO_STATE_ENCRYPTING) {
+		start_gatt_setup(conninfo);
+	}
+}
+
+/* reconnecting with an existing bond only encrypts, this is a new key */
+static void pairing_complete(struct bt_conn *conn, bool bonded)
+{
+	if (IS_ENABLED(CONFIG_CENTRAL_BROADCAST) && bonded) {
+		main_broadcast_bonded(bt_conn_get_dst(conn));
+	}
+}
+
+static void disconnected(struct bt_conn *conn, uint8_t reason)
+{
+	char addr[BT_ADDR_LE_STR_LEN];
+	struct conninfo *conninfo;
+	int err;
+
+	conninfo = conninfo_find(conn);
+	if (!conninfo) {
+		LOG_ERR("disconnected with unknown connection");
+		return;
+	}
+
+	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+
+	LOG_INF("Disconnected: %s (reason 0x%02x)", log_strdup(addr), reason);
+
+	if (!conninfo->polled) {
+		err = main_event_post_connection_status(&bt_conn_get_dst(conn)->a, false);
+		if (err) {
+			LOG_ERR("Failed to queue connection status: %d", err);
+		}
+	}
+
+	if (creating == conn) {
+		creating = NULL;
+	}
+
+	// lost during the setup, probably at the edge of the range
+	if (conninfo->state != CONNINFO_STATE_READY) {
+		peer_connect_failed(bt_conn_get_dst(conn));
+	}
+
+	// the faster PHY didn't hold up, stay below it with this device
+	if (IS_ENABLED(CONFIG_CENTRAL_PHY_ADAPT) && reason == BT_HCI_ERR_CONN_TIMEOUT &&
+	    conninfo->peer && conninfo->phy > MAIN_PHY_CODED_S8 &&
+	    k_uptime_get() - conninfo->phy_since <
+		    2 * CONFIG_CENTRAL_PHY_ADAPT_INTERVAL * MSEC_PER_SEC) {
+		conninfo->peer->phy_backoff = MAIN_PHY_2M - conninfo->phy + 1;
+		LOG_WRN("Link lost on %s, not using it again", link_phys[conninfo->phy].name);
+	}
+
+	// the values got read, even if the link didn't last until the end of the poll
+	if (conninfo->polled) {
+		if (conninfo->state == CONNINFO_STATE_READY) {
+			poll_done(conninfo->peer);
+		}
+
+		bt_conn_unref(conn);
+		conninfo_free(conninfo);
+
 		start_scan();
 		return;
 	}
+
+	bt_conn_unref(conn);
+	conninfo_free(conninfo);
+
+	pipeline_restart();
+	scan_fast();
+}
+
+static struct bt_conn_cb conn_callbacks = {
+	.connected = connected,
+	.disconnected = disconnected,
+	.security_changed = security_changed,
+#ifdef CONFIG_BT_USER_DATA_LEN_UPDATE
+	.le_data_len_updated = le_data_len_updated,
+#endif
+#ifdef CONFIG_CENTRAL_PHY_ADAPT
+	.le_phy_updated = le_phy_updated,
+#endif
+};
+
+static struct bt_conn_auth_cb auth_callbacks = {
+	.pairing_complete = pairing_complete,
+};
+
+static void bt_ready(void)
+{
+	printk("Bluetooth initialized\n");
+
+	if (IS_ENABLED(CONFIG_SETTINGS)) {
+		settings_load();
+	}
+
+	main_peer_sync_bonds();
+}
+
+void main_init_bluetooth(void)
+{
+	int err;
+
+	err = bt_enable(NULL);
+	if (err) {
+		LOG_ERR("Bluetooth init failed (err %d)", err);
+		return;
+	}
+	LOG_INF("Bluetooth initialized");
+
+	bt_ready();
+	bt_conn_cb_register(&conn_callbacks);
+	bt_conn_auth_cb_register(&auth_callbacks);
+	pipeline_restart();
+
+	bonds_checksum = bonds_checksum_get();
+	whitelist_load();
+	k_work_init_delayable(&scan_work, scan_work_handler);
+	k_work_init_delayable(&poll_work, poll_work_handler);
+	scan_fast();
+
+	k_work_init_delayable(&bond_sync_work, bond_sync_work_handler);
+	k_work_schedule(&bond_sync_work, K_SECONDS(CONFIG_CENTRAL_BOND_SYNC_INTERVAL));
+
+#ifdef CONFIG_CENTRAL_PHY_ADAPT
+	k_work_init_delayable(&phy_work, phy_work_handler);
+	k_work_schedule(&phy_work, K_SECONDS(CONFIG_CENTRAL_PHY_ADAPT_INTERVAL));
+#endif
+}
+
+#ifdef CONFIG_SHELL
+static const char *conninfo_state_str(enum conninfo_state state)
+{
+	switch (state) {
+	case CONNINFO_STATE_CONNECTING:
+		return "connecting";
+	case CONNINFO_STATE_ENCRYPTING:
+		return "encrypting";
+	case CONNINFO_STATE_DISCOVERING:
+		return "discovering";
+	case CONNINFO_STATE_READY:
+		return "ready";
+	case CONNINFO_STATE_DISCONNECTING:
+		return "disconnecting";
+	default:
+		return "unknown";
+	}
+}
+
+/* share of the time the radio spent scanning since boot */
+static void print_scan_stats(const struct shell *shell)
+{
+	int64_t time[ARRAY_SIZE(scan_timing)];
+	int64_t total = 0;
+	int64_t scanning = 0;
+	size_t i;
+
+	memcpy(time, scan_mode_time, sizeof(time));
+	time[scan_mode] += k_uptime_get() - scan_mode_since;
+
+	for (i = 0; i < ARRAY_SIZE(time); i++) {
+		total += time[i];
+		scanning += time[i] * scan_timing[i].window / scan_timing[i].interval;
+	}
+
+	shell_print(shell,
+		    "scanning %s, duty cycle %lld.%lld%%, fast %lld ms, slow %lld ms, off %lld ms",
+		    (scan_mode == SCAN_MODE_FAST) ? "fast" :
+		    (scan_mode == SCAN_MODE_SLOW) ? "slow" : "off",
+		    total ? scanning * 100 / total : 0,
+		    total ? scanning * 1000 / total % 10 : 0,
+		    time[SCAN_MODE_FAST],
+		    time[SCAN_MODE_SLOW],
+		    time[SCAN_MODE_OFF]);
+}
+
+void main_bt_print_status(const struct shell *shell)
+{
+	char addr[BT_ADDR_LE_STR_LEN];
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(conns); i++) {
+		if (!conns[i].conn) {
+			continue;
+		}
+
+		bt_addr_le_to_str(bt_conn_get_dst(conns[i].conn), addr, sizeof(addr));
+		shell_print(shell,
+			    "%s: %s, mtu %u, data length tx %u rx %u, phy %s, rssi %d",
+			    addr,
+			    conninfo_state_str(conns[i].state),
+			    conns[i].mtu,
+			    conns[i].tx_len,
+			    conns[i].rx_len,
+			    link_phys[conns[i].phy].name,
+			    conns[i].rssi_avg4 / 4);
+	}
+
+	shell_print(shell,
+		    "bonded: %zu, ready: %zu",
+		    num_bonds(),
+		    num_conns_in_state(CONNINFO_STATE_READY));
+
+	if (pipeline_start >= 0) {
+		shell_print(shell,
+			    "waiting for all devices since %lld ms",
+			    k_uptime_get() - pipeline_start);
+	}
+	if (pipeline_last_duration >= 0) {
+		shell_print(shell, "last time to all connected: %lld ms", pipeline_last_duration);
+	}
+
+	print_scan_stats(shell);
+}
+#endif
+
+static void req_queue_kick(struct conninfo *conninfo);
+
+static void req_list_append(sys_slist_t *list, struct gatt_req *req)
+{
+	k_spinlock_key_t key = k_spin_lock(&conninfo_lock);
+
+	sys_slist_append(list, &req->node);
+	k_spin_unlock(&conninfo_lock, key);
+}
+
+static sys_snode_t *req_list_get(sys_slist_t *list)
+{
+	k_spinlock_key_t key = k_spin_lock(&conninfo_lock);
+	sys_snode_t *node = sys_slist_get(list);
+
+	k_spin_unlock(&conninfo_lock, key);
+
+	return node;
+}
+
+/* drop the rest of a write batch after one of its writes failed */
+static void req_queue_abort_batch(struct conninfo *conninfo)
+{
+	struct gatt_req *req;
+	sys_snode_t *node;
+	bool more = true;
+
+	while (more && (node = req_list_get(&conninfo->req_queue))) {
+		req = CONTAINER_OF(node, struct gatt_req, node);
+		more = req->batch_more;
+
+		LOG_WRN("Dropping write to %04x of failed batch", req->handle);
+		k_mem_slab_free(&gatt_req_slab, (void **)&node);
+	}
+}
+
+/* the head of the queue is done */
+static void req_queue_pop(struct conninfo *conninfo, bool failed)
+{
+	sys_snode_t *node = req_list_get(&conninfo->req_queue);
+	struct gatt_req *req;
+	bool batch_more;
+
+	conninfo->req_busy = false;
+
+	// a disconnect might have flushed the queue already
+	if (!node) {
+		LOG_WRN("request queue is empty");
+		return;
+	}
+
+	req = CONTAINER_OF(node, struct gatt_req, node);
+	batch_more = req->batch_more;
+	k_mem_slab_free(&gatt_req_slab, (void **)&node);
+
+	if (failed && batch_more) {
+		req_queue_abort_batch(conninfo);
+	}
 }
 
-static void disconnected(struct bt_conn *conn, uint8_t reason)
+static void write_func(struct bt_conn *conn, uint8_t err, struct bt_gatt_write_params *params)
 {
-	char addr[BT_ADDR_LE_STR_LEN];
-	char addr_nole[BT_ADDR_STR_LEN];
-	struct conninfo *conninfo;
-	int err;
+	struct conninfo *conninfo = CONTAINER_OF(params, struct conninfo, write_params);
 
-	conninfo = conninfo_find(conn);
-	if (!conninfo) {
-		LOG_ERR("disconnected with unknown connection");
-		return;
+	LOG_INF("Write complete: err 0x%02x", err);
+
+	// the device might not notify the new value, read it again next time
+	value_cache_invalidate(conninfo, params->handle);
+
+	req_queue_pop(conninfo, err);
+	req_queue_kick(conninfo);
+}
+
+static uint8_t conninfo_chrc_index(const struct conninfo *conninfo, uint16_t value_handle)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(conninfo->sub_params); i++) {
+		if (conninfo->sub_params[i].value_handle == value_handle) {
+			return i;
+		}
 	}
 
-	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
-	bt_addr_to_str(&bt_conn_get_dst(conn)->a, addr_nole, sizeof(addr_nole));
+	return MAIN_EVENT_CHRC_UNKNOWN;
+}
 
-	LOG_INF("Disconnected: %s (reason 0x%02x)", log_strdup(addr), reason);
+static uint8_t value_read_func(struct bt_conn *conn,
+			       uint8_t err,
+			       struct bt_gatt_read_params *params,
+			       const void *data,
+			       uint16_t length)
+{
+	struct conninfo *conninfo = CONTAINER_OF(params, struct conninfo, value_read_params);
+	uint16_t handle = params->single.handle;
+	uint16_t offset = params->single.offset;
+	int rc;
+
+	// the previous part filled the MTU exactly and there's nothing left
+	if (offset && (err == BT_ATT_ERR_INVALID_OFFSET || err == BT_ATT_ERR_ATTRIBUTE_NOT_LONG)) {
+		err = 0;
+		data = NULL;
+	}
 
-	err = main_publish_connection_status(addr_nole, false);
 	if (err) {
-		LOG_ERR("Failed to publish connection status: %d", err);
+		LOG_ERR("Read of %04x failed: err 0x%02x", handle, err);
+		goto done;
 	}
 
-	bt_conn_unref(conn);
-	conninfo_free(conninfo);
+	if (data) {
+		if (offset + length > sizeof(conninfo->read_buf)) {
+			LOG_ERR("Value of %04x is longer than %zu bytes",
+				handle,
+				sizeof(conninfo->read_buf));
+			goto done;
+		}
 
-	start_scan();
+		memcpy(&conninfo->read_buf[offset], data, length);
+		conninfo->read_len = offset + length;
+		return BT_GATT_ITER_CONTINUE;
+	}
+
+	conninfo->notified = true;
+	value_cache_put(conninfo, handle, conninfo->read_buf, conninfo->read_len);
+
+	rc = main_event_post_characteristic_value(&bt_conn_get_dst(conn)->a,
+						  handle,
+						  conninfo_chrc_index(conninfo, handle),
+						  conninfo->read_buf,
+						  conninfo->read_len,
+						  true);
+	if (rc) {
+		LOG_ERR("failed to queue characteristic value: %d", rc);
+	}
+
+done:
+	req_queue_pop(conninfo, false);
+	req_queue_kick(conninfo);
+
+	return BT_GATT_ITER_STOP;
 }
 
-static struct bt_conn_cb conn_callbacks = {
-	.connected = connected,
-	.disconnected = disconnected,
-};
+/*
+ * Send the head of the queue unless a request is in flight already.
+ *
+ * On the MQTT thread the GATT calls can block waiting for buffers, and a
+ * disconnect in the meantime frees the slot along with the queue. The caller
+ * holds a reference to the connection, so the slot can't be taken by another
+ * one, and it's enough to check it's still ours after every call.
+ */
+static void req_queue_kick(struct conninfo *conninfo)
+{
+	int err;
+	struct bt_conn *conn = conninfo->conn;
+	struct bt_gatt_write_params *wparams = &conninfo->write_params;
+	struct bt_gatt_read_params *rparams = &conninfo->value_read_params;
+	struct gatt_req *req;
+
+	while (conn && !conninfo->req_busy && !sys_slist_is_empty(&conninfo->req_queue)) {
+		req = SYS_SLIST_PEEK_HEAD_CONTAINER(&conninfo->req_queue, req, node);
+
+		if (req->type == GATT_REQ_WRITE_CMD) {
+			err = bt_gatt_write_without_response(conn, req->handle, req->data, req->len,
+							     false);
+			if (conninfo->conn != conn) {
+				LOG_WRN("Disconnected while sending write command");
+				return;
+			}
 
-static void bt_ready(void)
+			if (err) {
+				LOG_ERR("Write command to %04x failed (err %d)", req->handle, err);
+			} else {
+				LOG_INF("Write command sent");
+			}
+
+			req_queue_pop(conninfo, err);
+			continue;
+		}
+
+		conninfo->req_busy = true;
+
+		if (req->type == GATT_REQ_READ) {
+			conninfo->read_len = 0;
+
+			rparams->func = value_read_func;
+			rparams->handle_count = 1;
+			rparams->single.handle = req->handle;
+			rparams->single.offset = 0;
+
+			err = bt_gatt_read(conn, rparams);
+		} else {
+			wparams->func = write_func;
+			wparams->handle = req->handle;
+			// values longer than the MTU go out as prepare writes and one execute
+			wparams->offset = 0;
+			wparams->data = req->data;
+			wparams->length = req->len;
+
+			err = bt_gatt_write(conn, wparams);
+		}
+
+		if (conninfo->conn != conn) {
+			LOG_WRN("Disconnected while sending request");
+			return;
+		}
+
+		if (err) {
+			LOG_ERR("Request to %04x failed (err %d)", req->handle, err);
+			req_queue_pop(conninfo, true);
+		}
+	}
+}
+
+/* the latest request for handle, with_busy includes the one in flight */
+static struct gatt_req *req_queue_last(struct conninfo *conninfo, uint16_t handle, bool with_busy)
 {
-	printk("Bluetooth initialized\n");
+	struct gatt_req *req;
+	struct gatt_req *last = NULL;
 
-	if (IS_ENABLED(CONFIG_SETTINGS)) {
-		settings_load();
+	SYS_SLIST_FOR_EACH_CONTAINER(&conninfo->req_queue, req, node) {
+		if (!with_busy && conninfo->req_busy &&
+		    &req->node == sys_slist_peek_head(&conninfo->req_queue)) {
+			continue;
+		}
+
+		if (req->handle == handle) {
+			last = req;
+		}
 	}
+
+	return last;
 }
 
-void main_init_bluetooth(void)
+/*
+ * Replace the value of a write to the same handle which didn't go out yet.
+ * Batched writes are kept, so is anything queued before them or before a read.
+ */
+static bool req_queue_coalesce(struct conninfo *conninfo,
+			       uint16_t handle,
+			       const void *data,
+			       size_t len,
+			       enum gatt_req_type type)
+{
+	k_spinlock_key_t key = k_spin_lock(&conninfo_lock);
+	struct gatt_req *last = req_queue_last(conninfo, handle, false);
+	bool coalesced = false;
+
+	if (last && last->type != GATT_REQ_READ && !last->batch) {
+		memcpy(last->data, data, len);
+		last->len = len;
+		last->type = type;
+		coalesced = true;
+	}
+
+	k_spin_unlock(&conninfo_lock, key);
+
+	return coalesced;
+}
+
+static const struct main_gatt_chrc *conninfo_find_chrc(const struct conninfo *conninfo,
+						       uint16_t value_handle)
+{
+	const struct main_gatt_cache *gatt;
+	size_t i;
+
+	if (!conninfo->peer) {
+		return NULL;
+	}
+
+	gatt = &conninfo->peer->gatt;
+	for (i = 0; i < gatt->num_chrcs; i++) {
+		if (gatt->chrcs[i].value_handle == value_handle) {
+			return &gatt->chrcs[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* a queued request, blocks the MQTT thread while all are in use */
+static struct gatt_req *req_alloc(k_timeout_t timeout)
 {
+	struct gatt_req *req;
 	int err;
 
-	err = bt_enable(NULL);
+	err = k_mem_slab_alloc(&gatt_req_slab, (void **)&req, timeout);
 	if (err) {
-		LOG_ERR("Bluetooth init failed (err %d)", err);
-		return;
+		LOG_ERR("No free request buffer");
+		return NULL;
 	}
-	LOG_INF("Bluetooth initialized");
 
-	bt_ready();
-	bt_conn_cb_register(&conn_callbacks);
-	start_scan();
+	memset(req, 0, sizeof(*req));
+
+	return req;
 }
 
-static void write_func(struct bt_conn *conn, uint8_t err, struct bt_gatt_write_params *params)
+/*
+ * A buffer for a value of len bytes, which the caller fills in and hands to
+ * main_set_bluetooth_value(). This way the payload is only copied once.
+ */
+void *main_bt_value_alloc(size_t len, uint32_t flags)
 {
-	LOG_INF("Write complete: err 0x%02x", err);
+	struct gatt_req *req;
+
+	if (len > sizeof(req->data)) {
+		LOG_ERR("too much data");
+		return NULL;
+	}
+
+	// a batch waits for its flush, blocking on it would never end
+	req = req_alloc((flags & MAIN_WRITE_BATCH) ? K_NO_WAIT : GATT_REQ_ALLOC_TIMEOUT);
+	if (!req) {
+		return NULL;
+	}
+
+	return req->data;
+}
+
+/* for a buffer which didn't make it to main_set_bluetooth_value() */
+void main_bt_value_free(void *data)
+{
+	struct gatt_req *req = CONTAINER_OF(data, struct gatt_req, data);
 
-	memset(params, 0, sizeof(*params));
+	k_mem_slab_free(&gatt_req_slab, (void **)&req);
 }
 
-int main_set_bluetooth_value(const bt_addr_t *addr, uint16_t handle, void *data, size_t len)
+/* takes over data, which has to come from main_bt_value_alloc() */
+int main_set_bluetooth_value(const bt_addr_t *addr,
+			     uint16_t handle,
+			     void *data,
+			     size_t len,
+			     uint32_t flags)
 {
+	enum gatt_req_type type = GATT_REQ_WRITE;
+	bool batch = flags & MAIN_WRITE_BATCH;
+	bt_addr_le_t peer = {
+		.type = BT_ADDR_LE_RANDOM,
+		.a = *addr,
+	};
 	struct bt_conn *conn;
+	struct conninfo *conninfo;
+	const struct main_gatt_chrc *chrc;
+	struct gatt_req *req = CONTAINER_OF(data, struct gatt_req, data);
+	int err = 0;
+
+	conninfo = conninfo_lookup(&peer, &conn);
+	if (!conninfo) {
+		LOG_ERR("can't find connection");
+		main_bt_value_free(data);
+		return -ENOENT;
+	}
+
+	if (flags & MAIN_WRITE_WITHOUT_RESPONSE) {
+		chrc = conninfo_find_chrc(conninfo, handle);
+		if (batch || len > bt_gatt_get_mtu(conninfo->conn) - 3) {
+			LOG_WRN("write command can't be long or batched, "
+				"using write request for %04x",
+				handle);
+		} else if (!chrc || !(chrc->properties & BT_GATT_CHRC_WRITE_WITHOUT_RESP)) {
+			LOG_WRN("%04x doesn't support write without response", handle);
+		} else {
+			type = GATT_REQ_WRITE_CMD;
+		}
+	}
+
+	if (!batch && req_queue_coalesce(conninfo, handle, data, len, type)) {
+		LOG_INF("Write to %04x coalesced", handle);
+		main_bt_value_free(data);
+		goto unref_conn;
+	}
+
+	req->type = type;
+	req->handle = handle;
+	req->len = len;
+	req->batch = batch;
+
+	if (batch) {
+		req_list_append(&conninfo->batch_queue, req);
+		LOG_INF("Write to %04x waiting for flush", handle);
+		goto unref_conn;
+	}
+
+	req_list_append(&conninfo->req_queue, req);
+
+	LOG_INF("Write pending");
+	req_queue_kick(conninfo);
+
+unref_conn:
+	bt_conn_unref(conn);
+
+	return err;
+}
+
+/*
+ * A value from a notification or read which isn't older than
+ * CONFIG_CENTRAL_VALUE_CACHE_TTL, as an event ready to publish.
+ */
+bool main_bt_value_cached(const bt_addr_t *addr, uint16_t handle, struct main_event *evt)
+{
 	bt_addr_le_t peer = {
 		.type = BT_ADDR_LE_RANDOM,
 		.a = *addr,
 	};
-	int err;
 	struct conninfo *conninfo;
-	struct bt_gatt_write_params *write_params = NULL;
-	size_t paramid;
+	const struct value_cache_entry *entry;
+	k_spinlock_key_t key;
+	bool found = false;
 
-	if (len == 0) {
-		LOG_ERR("No data to send");
-		return -EINVAL;
+	key = k_spin_lock(&conninfo_lock);
+
+	conninfo = conninfo_find_addr(&peer);
+	if (!conninfo) {
+		goto unlock;
 	}
 
-	if (len > sizeof(conninfo->gatt_write_buf)) {
-		LOG_ERR("too much data");
-		return -EINVAL;
+	entry = value_cache_find(conninfo, handle);
+	if (!entry || k_uptime_get() - entry->time > CONFIG_CENTRAL_VALUE_CACHE_TTL) {
+		goto unlock;
 	}
 
-	conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, &peer);
-	if (!conn) {
+	evt->timestamp = k_uptime_get_32();
+	bt_addr_copy(&evt->addr, addr);
+	evt->type = MAIN_EVENT_CHARACTERISTIC_VALUE;
+	evt->handle = handle;
+	evt->chrc = conninfo_chrc_index(conninfo, handle);
+	evt->solicited = true;
+	evt->len = entry->len;
+	memcpy(evt->data, entry->data, entry->len);
+	found = true;
+
+unlock:
+	k_spin_unlock(&conninfo_lock, key);
+
+	return found;
+}
+
+/* the value gets published like a notification */
+int main_read_bluetooth_value(const bt_addr_t *addr, uint16_t handle)
+{
+	bt_addr_le_t peer = {
+		.type = BT_ADDR_LE_RANDOM,
+		.a = *addr,
+	};
+	struct bt_conn *conn;
+	struct conninfo *conninfo;
+	struct gatt_req *req;
+	k_spinlock_key_t key;
+	bool pending;
+	int err = 0;
+
+	conninfo = conninfo_lookup(&peer, &conn);
+	if (!conninfo) {
 		LOG_ERR("can't find connection");
 		return -ENOENT;
 	}
 
+	// a read which is in flight already gets a value at least as new
+	key = k_spin_lock(&conninfo_lock);
+	req = req_queue_last(conninfo, handle, true);
+	pending = req && req->type == GATT_REQ_READ;
+	k_spin_unlock(&conninfo_lock, key);
+
+	if (pending) {
+		LOG_INF("Read of %04x already pending", handle);
+		goto unref_conn;
+	}
+
+	req = req_alloc(GATT_REQ_ALLOC_TIMEOUT);
+	if (!req) {
+		err = -EBUSY;
+		goto unref_conn;
+	}
+
+	// the connection might have gone away while we were waiting
 	conninfo = conninfo_find(conn);
 	if (!conninfo) {
-		LOG_ERR("attempted write to unknown connection");
+		LOG_ERR("connection lost while waiting for a request buffer");
+		k_mem_slab_free(&gatt_req_slab, (void **)&req);
 		err = -ENOENT;
 		goto unref_conn;
 	}
 
-	for (paramid = 0; paramid < ARRAY_SIZE(conninfo->write_params); paramid++) {
-		if (conninfo->write_params[paramid].func == NULL) {
-			write_params = &conninfo->write_params[paramid];
+	req->type = GATT_REQ_READ;
+	req->handle = handle;
+	req_list_append(&conninfo->req_queue, req);
+
+	LOG_INF("Read pending");
+	req_queue_kick(conninfo);
+
+unref_conn:
+	bt_conn_unref(conn);
+
+	return err;
+}
+
+/*
+ * Send the batched writes back to back. Nothing else gets in between and
+ * once one of them fails the rest is dropped, but the ones before it stay
+ * written. Each is a write of its own, the batch isn't atomic.
+ */
+int main_flush_bluetooth_values(const bt_addr_t *addr)
+{
+	bt_addr_le_t peer = {
+		.type = BT_ADDR_LE_RANDOM,
+		.a = *addr,
+	};
+	struct bt_conn *conn;
+	struct conninfo *conninfo;
+	struct gatt_req *req;
+	sys_snode_t *node;
+	k_spinlock_key_t key;
+
+	conninfo = conninfo_lookup(&peer, &conn);
+	if (!conninfo) {
+		LOG_ERR("can't find connection");
+		return -ENOENT;
+	}
+
+	if (sys_slist_is_empty(&conninfo->batch_queue)) {
+		LOG_WRN("nothing to flush");
+		bt_conn_unref(conn);
+		return 0;
+	}
+
+	key = k_spin_lock(&conninfo_lock);
+	while ((node = sys_slist_get(&conninfo->batch_queue))) {
+		req = CONTAINER_OF(node, struct gatt_req, node);
+		req->batch_more = !sys_slist_is_empty(&conninfo->batch_queue);
+		sys_slist_append(&conninfo->req_queue, node);
+	}
+	k_spin_unlock(&conninfo_lock, key);
+
+	LOG_INF("Batch pending");
+	req_queue_kick(conninfo);
+	bt_conn_unref(conn);
+
+	return 0;
+}
+
+/*
+ * One read per handle, starting at first, for devices which don't support
+ * read multiple variable length and for what didn't fit its response.
+ */
+static void snapshot_read_each(struct conninfo *conninfo, size_t first)
+{
+	struct gatt_req *req;
+	size_t i;
+
+	for (i = first; i < conninfo->snapshot_count; i++) {
+		// the BT RX thread must not block, what doesn't fit is retried
+		req = req_alloc(K_NO_WAIT);
+		if (!req) {
 			break;
 		}
+
+		req->type = GATT_REQ_READ;
+		req->handle = conninfo->snapshot_handles[i];
+		req_list_append(&conninfo->req_queue, req);
 	}
-	if (!write_params) {
-		LOG_ERR("No free write params");
-		err = -EBUSY;
-		goto unref_conn;
+
+	if (i == conninfo->snapshot_count) {
+		conninfo->snapshot_retries = 0;
+	} else if (conninfo->snapshot_retries < SNAPSHOT_RETRY_MAX) {
+		conninfo->snapshot_retry_pos = i;
+		k_work_reschedule(&conninfo->snapshot_retry_work,
+				  K_MSEC(SNAPSHOT_RETRY_DELAY_MS << conninfo->snapshot_retries));
+		conninfo->snapshot_retries++;
+	} else {
+		LOG_WRN("Skipping %zu snapshot reads, no request buffer",
+			conninfo->snapshot_count - i);
+		conninfo->snapshot_retries = 0;
 	}
 
-	if (write_params->func) {
-		LOG_ERR("Write ongoing");
-		err = -EBUSY;
-		goto unref_conn;
+	req_queue_kick(conninfo);
+}
+
+static void snapshot_retry_work_handler(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct conninfo *conninfo = CONTAINER_OF(dwork, struct conninfo, snapshot_retry_work);
+
+	if (!conninfo->conn) {
+		return;
 	}
 
-	memcpy(conninfo->gatt_write_buf, data, len);
-	write_params->length = len;
-	write_params->data = conninfo->gatt_write_buf;
-	write_params->handle = handle;
-	write_params->offset = 0;
-	write_params->func = write_func;
+	snapshot_read_each(conninfo, conninfo->snapshot_retry_pos);
+}
+
+static uint8_t snapshot_read_func(struct bt_conn *conn,
+				  uint8_t err,
+				  struct bt_gatt_read_params *params,
+				  const void *data,
+				  uint16_t length)
+{
+	struct conninfo *conninfo = CONTAINER_OF(params, struct conninfo, snapshot_params);
+	uint16_t handle;
+	int rc;
 
-	err = bt_gatt_write(conn, write_params);
 	if (err) {
-		LOG_ERR("Write failed (err %d)", err);
-		goto free_write_params;
+		LOG_WRN("Snapshot read failed (err 0x%02x), reading one by one", err);
+		conninfo->snapshot_busy = false;
+		snapshot_read_each(conninfo, 0);
+		return BT_GATT_ITER_STOP;
 	}
 
-	LOG_INF("Write pending");
-	bt_conn_unref(conn);
-	return 0;
+	// values arrive in the order of the handles we asked for
+	if (!data || conninfo->snapshot_pos >= conninfo->snapshot_count) {
+		LOG_INF("Snapshot read %zu of %zu values",
+			conninfo->snapshot_pos,
+			conninfo->snapshot_count);
+		conninfo->snapshot_busy = false;
+
+		// the response ends at the MTU, the last value in it might be cut off as well
+		if (conninfo->snapshot_pos < conninfo->snapshot_count) {
+			snapshot_read_each(conninfo, conninfo->snapshot_pos ?
+							     conninfo->snapshot_pos - 1 : 0);
+		}
 
-free_write_params:
-	write_params->func = NULL;
-unref_conn:
-	bt_conn_unref(conn);
-	return err;
+		return BT_GATT_ITER_STOP;
+	}
+
+	handle = conninfo->snapshot_handles[conninfo->snapshot_pos++];
+
+	conninfo->notified = true;
+	value_cache_put(conninfo, handle, data, length);
+
+	rc = main_event_post_characteristic_value(&bt_conn_get_dst(conn)->a,
+						  handle,
+						  conninfo_chrc_index(conninfo, handle),
+						  data,
+						  length,
+						  true);
+	if (rc) {
+		LOG_ERR("failed to queue characteristic value: %d", rc);
+	}
+
+	return BT_GATT_ITER_CONTINUE;
+}
+
+/*
+ * Values which rarely change might not be notified for hours, so read all
+ * subscribed ones with a single read multiple variable length request.
+ */
+static void snapshot_read(struct conninfo *conninfo)
+{
+	const struct main_gatt_cache *gatt = &conninfo->peer->gatt;
+	struct bt_gatt_read_params *params = &conninfo->snapshot_params;
+	size_t i;
+	int err;
+
+	conninfo->snapshot_count = 0;
+	conninfo->snapshot_pos = 0;
+
+	for (i = 0; i < gatt->num_chrcs; i++) {
+		if (conninfo->sub_params[i].notify &&
+		    (gatt->chrcs[i].properties & BT_GATT_CHRC_READ)) {
+			conninfo->snapshot_handles[conninfo->snapshot_count++] =
+				gatt->chrcs[i].value_handle;
+		}
+	}
+
+	// a single handle would be a plain read, which the request queue does already
+	if (conninfo->snapshot_count < 2) {
+		snapshot_read_each(conninfo, 0);
+		return;
+	}
+
+	params->func = snapshot_read_func;
+	params->handle_count = conninfo->snapshot_count;
+	params->multiple.handles = conninfo->snapshot_handles;
+	params->multiple.variable = true;
+
+	err = bt_gatt_read(conninfo->conn, params);
+	if (err) {
+		LOG_WRN("Snapshot read not possible (err %d), reading one by one", err);
+		snapshot_read_each(conninfo, 0);
+		return;
+	}
+
+	conninfo->snapshot_busy = true;
 }
 
 static void publish_bond_cb(const struct bt_bond_info *info, void *ctx_)
 {
 	int err;
 	struct bt_conn *conn;
-	char addr[BT_ADDR_STR_LEN];
+	struct conninfo *conninfo;
+	struct main_peer *peer;
 	bool connected;
 
-	bt_addr_to_str(&info->addr.a, addr, sizeof(addr));
+	// they're disconnected most of the time, that's expected
+	peer = main_peer_find(&info->addr);
+	if (peer && (peer->polled || peer->broadcast)) {
+		return;
+	}
 
 	conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, &info->addr);
 	connected = (conn && main_bt_conn_is_connected(conn));
@@ -476,10 +2678,18 @@ static void publish_bond_cb(const struct bt_bond_info *info, void *ctx_)
 		conn = NULL;
 	}
 
-	err = main_publish_connection_status(addr, connected);
+	err = main_publish_connection_status(&info->addr.a, connected);
 	if (err) {
 		LOG_ERR("Failed to publish connection status: %d", err);
 	}
+
+	conninfo = conninfo_find_addr(&info->addr);
+	if (connected && conninfo) {
+		err = main_publish_phy(&info->addr.a, conninfo->phy);
+		if (err) {
+			LOG_ERR("Failed to publish PHY: %d", err);
+		}
+	}
 }
 
 void main_publish_all_connection_statuses(void)
@@ -1,9 +1,29 @@
 #include <bluetooth/buf.h>
 #include <bluetooth/conn.h>
+#include <string.h>
 
 #include "conn_internal.h"
+#include "keys.h"
 
 bool main_bt_conn_is_connected(struct bt_conn *conn)
 {
 	return (conn->state == BT_CONN_CONNECTED);
 }
+
+/*
+ * Only LE secure connections give both sides the same LTK. The apps are built
+ * separately and share no sources, so apps/co2sensor has a copy of this, keep
+ * them the same.
+ */
+int main_bt_bond_ltk(const bt_addr_le_t *addr, uint8_t ltk[16])
+{
+	struct bt_keys *keys = bt_keys_find(BT_KEYS_LTK_P256, BT_ID_DEFAULT, addr);
+
+	if (!keys) {
+		return -ENOENT;
+	}
+
+	memcpy(ltk, keys->ltk.val, sizeof(keys->ltk.val));
+
+	return 0;
+}
@@ -0,0 +1,187 @@
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/crypto.h>
+#include <sys/byteorder.h>
+#include <sys/util.h>
+
+#include "main.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(main_broadcast, LOG_LEVEL_DBG);
+
+/*
+ * Sensors which don't keep a connection put their values into the
+ * manufacturer specific data of their advertisements:
+ *
+ *   company id (2) | version (1) | session (4) | counter (4) | values | MIC (4)
+ *
+ * The values are records of handle (2), length (1) and data, just like the
+ * notifications they replace. They're encrypted with AES-CCM under a key
+ * derived from the LTK of the bond, session and counter make up the nonce
+ * and are authenticated with it. The session is random for every boot of
+ * the sensor, the counter increases whenever a value changed and is kept
+ * across reboots, so a broadcast with a counter not above the last one is
+ * always a replay.
+ * Keep in sync with apps/co2sensor/src/bluetooth.c.
+ */
+#define BROADCAST_COMPANY_ID 0xffff
+#define BROADCAST_VERSION 1
+#define BROADCAST_HEADER_LEN 9
+#define BROADCAST_MIC_LEN 4
+#define BROADCAST_RECORD_HEADER_LEN 3
+
+/* AES of this with the LTK is the broadcast key, so the LTK itself isn't used for it */
+static const uint8_t key_label[16] = "btlr broadcast";
+
+struct broadcast_frame {
+	/* starts with the version, the company id is stripped */
+	const uint8_t *data;
+	uint8_t len;
+};
+
+static bool ad_find_frame(struct bt_data *data, void *user_data)
+{
+	struct broadcast_frame *frame = user_data;
+
+	if (data->type != BT_DATA_MANUFACTURER_DATA ||
+	    data->data_len < 2 + BROADCAST_HEADER_LEN + BROADCAST_MIC_LEN ||
+	    sys_get_le16(data->data) != BROADCAST_COMPANY_ID ||
+	    data->data[2] != BROADCAST_VERSION) {
+		return true;
+	}
+
+	frame->data = data->data + 2;
+	frame->len = data->data_len - 2;
+
+	return false;
+}
+
+static int frame_decrypt(const bt_addr_le_t *addr,
+			 const struct broadcast_frame *frame,
+			 uint8_t *plaintext)
+{
+	uint8_t ltk[16];
+	uint8_t key[16];
+	uint8_t nonce[13] = { 0 };
+	int err;
+
+	err = main_bt_bond_ltk(addr, ltk);
+	if (err) {
+		return err;
+	}
+
+	err = bt_encrypt_be(ltk, key_label, key);
+	if (err) {
+		return err;
+	}
+
+	memcpy(nonce, &frame->data[1], 8);
+
+	return bt_ccm_decrypt(key,
+			      nonce,
+			      frame->data + BROADCAST_HEADER_LEN,
+			      frame->len - BROADCAST_HEADER_LEN - BROADCAST_MIC_LEN,
+			      frame->data,
+			      BROADCAST_HEADER_LEN,
+			      plaintext,
+			      BROADCAST_MIC_LEN);
+}
+
+/* every record is queued like a notification */
+static void post_records(const bt_addr_le_t *addr, const uint8_t *data, size_t len)
+{
+	uint16_t handle;
+	uint8_t value_len;
+	int err;
+
+	while (len >= BROADCAST_RECORD_HEADER_LEN) {
+		handle = sys_get_le16(data);
+		value_len = data[2];
+		data += BROADCAST_RECORD_HEADER_LEN;
+		len -= BROADCAST_RECORD_HEADER_LEN;
+
+		if (value_len > len) {
+			LOG_ERR("truncated broadcast record");
+			return;
+		}
+
+		err = main_event_post_characteristic_value(&addr->a,
+							   handle,
+							   MAIN_EVENT_CHRC_UNKNOWN,
+							   data,
+							   value_len,
+							   false);
+		if (err) {
+			LOG_ERR("failed to queue characteristic value: %d", err);
+		}
+
+		data += value_len;
+		len -= value_len;
+	}
+}
+
+/*
+ * Called for advertisements of bonded devices, returns true if the device
+ * broadcasts its values and doesn't have to be connected.
+ */
+bool main_broadcast_handle(const bt_addr_le_t *addr, struct net_buf_simple *ad)
+{
+	struct broadcast_frame frame = { 0 };
+	struct net_buf_simple_state state;
+	uint8_t plaintext[CONFIG_CENTRAL_BROADCAST_MAX_LEN];
+	struct main_peer *peer;
+	uint32_t counter;
+	int err;
+
+	net_buf_simple_save(ad, &state);
+	bt_data_parse(ad, ad_find_frame, &frame);
+	net_buf_simple_restore(ad, &state);
+
+	if (!frame.data) {
+		return false;
+	}
+
+	if (frame.len - BROADCAST_HEADER_LEN - BROADCAST_MIC_LEN > sizeof(plaintext)) {
+		LOG_ERR("broadcast too long: %u", frame.len);
+		return false;
+	}
+
+	peer = main_peer_get(addr);
+	if (!peer) {
+		return false;
+	}
+
+	counter = sys_get_le32(&frame.data[5]);
+
+	// the sensor repeats its advertisement until a value changes
+	if (peer->broadcast && counter <= peer->broadcast_counter) {
+		return true;
+	}
+
+	// a stale bond, connecting sorts that out
+	err = frame_decrypt(addr, &frame, plaintext);
+	if (err) {
+		LOG_WRN("failed to decrypt broadcast: %d", err);
+		return false;
+	}
+
+	if (!peer->broadcast) {
+		LOG_INF("device broadcasts its values, not connecting");
+	}
+
+	peer->broadcast = true;
+	peer->broadcast_counter = counter;
+
+	post_records(addr, plaintext, frame.len - BROADCAST_HEADER_LEN - BROADCAST_MIC_LEN);
+
+	return true;
+}
+
+/* a new bond has a new key, the sensor's counter might have started over with it */
+void main_broadcast_bonded(const bt_addr_le_t *addr)
+{
+	struct main_peer *peer = main_peer_find(addr);
+
+	if (peer) {
+		peer->broadcast_counter = 0;
+	}
+}
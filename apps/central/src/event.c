@@ -0,0 +1,200 @@
+#include <net/socket.h>
+#include <sys/atomic.h>
+#include <sys/util.h>
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
+
+#include "main.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(main_event, LOG_LEVEL_DBG);
+
+BUILD_ASSERT(IS_POWER_OF_TWO(CONFIG_CENTRAL_EVENT_QUEUE_SIZE),
+	     "event queue size must be a power of two");
+
+/*
+ * Single producer (the BT RX thread), single consumer (the MQTT thread).
+ * head and tail are free running, only their difference matters.
+ * To drop the oldest event the producer advances tail as well, that's why
+ * the consumer only owns an event after moving tail past it with a CAS.
+ */
+static struct main_event ring[CONFIG_CENTRAL_EVENT_QUEUE_SIZE];
+static atomic_t head;
+static atomic_t tail;
+
+static atomic_t stat_posted;
+static atomic_t stat_dropped;
+static atomic_t stat_overwritten;
+static atomic_t stat_too_long;
+static atomic_t stat_high_water;
+
+/* the MQTT thread sleeps in poll(), so wake it through a socket */
+static int wakeup_fds[2] = { -1, -1 };
+
+static void wakeup(void)
+{
+	uint8_t dummy = 0;
+
+	if (wakeup_fds[1] < 0) {
+		return;
+	}
+
+	// if the socket is full a wakeup is pending anyway
+	zsock_send(wakeup_fds[1], &dummy, sizeof(dummy), ZSOCK_MSG_DONTWAIT);
+}
+
+static int event_put(const struct main_event *evt)
+{
+	uint32_t h = atomic_get(&head);
+	uint32_t t = atomic_get(&tail);
+	uint32_t used = h - t;
+
+	if (used >= ARRAY_SIZE(ring)) {
+		if (IS_ENABLED(CONFIG_CENTRAL_EVENT_OVERFLOW_DROP_NEWEST)) {
+			atomic_inc(&stat_dropped);
+			return -ENOMEM;
+		}
+
+		// fails if the consumer took it in the meantime, either way there's space now
+		atomic_cas(&tail, t, t + 1);
+		atomic_inc(&stat_overwritten);
+		used = ARRAY_SIZE(ring) - 1;
+	}
+
+	ring[h % ARRAY_SIZE(ring)] = *evt;
+	atomic_set(&head, h + 1);
+
+	atomic_inc(&stat_posted);
+	if (used + 1 > (uint32_t)atomic_get(&stat_high_water)) {
+		atomic_set(&stat_high_water, used + 1);
+	}
+
+	if (used == 0) {
+		wakeup();
+	}
+
+	return 0;
+}
+
+int main_event_post_characteristic_value(const bt_addr_t *addr,
+					 uint16_t handle,
+					 uint8_t chrc,
+					 const void *data,
+					 size_t data_len,
+					 bool solicited)
+{
+	struct main_event evt;
+
+	if (data_len > sizeof(evt.data)) {
+		atomic_inc(&stat_too_long);
+		return -ENOMEM;
+	}
+
+	evt.timestamp = k_uptime_get_32();
+	bt_addr_copy(&evt.addr, addr);
+	evt.type = MAIN_EVENT_CHARACTERISTIC_VALUE;
+	evt.handle = handle;
+	evt.chrc = chrc;
+	evt.solicited = solicited;
+	evt.len = data_len;
+	memcpy(evt.data, data, data_len);
+
+	return event_put(&evt);
+}
+
+int main_event_post_connection_status(const bt_addr_t *addr, bool connected)
+{
+	struct main_event evt;
+
+	evt.timestamp = k_uptime_get_32();
+	bt_addr_copy(&evt.addr, addr);
+	evt.type = MAIN_EVENT_CONNECTION_STATUS;
+	evt.handle = 0;
+	evt.chrc = MAIN_EVENT_CHRC_UNKNOWN;
+	evt.solicited = false;
+	evt.len = 1;
+	evt.data[0] = connected;
+
+	return event_put(&evt);
+}
+
+int main_event_post_phy(const bt_addr_t *addr, enum main_phy phy)
+{
+	struct main_event evt;
+
+	evt.timestamp = k_uptime_get_32();
+	bt_addr_copy(&evt.addr, addr);
+	evt.type = MAIN_EVENT_PHY;
+	evt.handle = 0;
+	evt.chrc = MAIN_EVENT_CHRC_UNKNOWN;
+	evt.solicited = false;
+	evt.len = 1;
+	evt.data[0] = phy;
+
+	return event_put(&evt);
+}
+
+bool main_event_get(struct main_event *evt)
+{
+	uint32_t t;
+
+	for (;;) {
+		t = atomic_get(&tail);
+		if (t == (uint32_t)atomic_get(&head)) {
+			return false;
+		}
+
+		*evt = ring[t % ARRAY_SIZE(ring)];
+
+		// the producer dropped this one while we were copying it
+		if (atomic_cas(&tail, t, t + 1)) {
+			return true;
+		}
+	}
+}
+
+void main_event_clear_wakeup(void)
+{
+	uint8_t buf[16];
+
+	while (zsock_recv(wakeup_fds[0], buf, sizeof(buf), ZSOCK_MSG_DONTWAIT) > 0) {
+	}
+}
+
+int main_event_init(void)
+{
+	int err;
+
+	err = zsock_socketpair(AF_UNIX, SOCK_STREAM, 0, wakeup_fds);
+	if (err) {
+		LOG_ERR("failed to create wakeup socket: %d", errno);
+		wakeup_fds[0] = -1;
+		wakeup_fds[1] = -1;
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* becomes readable when events got posted to an empty queue */
+int main_event_wakeup_fd(void)
+{
+	return wakeup_fds[0];
+}
+
+#ifdef CONFIG_SHELL
+void main_event_print_stats(const struct shell *shell)
+{
+	shell_print(shell,
+		    "events queued: %u, posted: %u, high water: %u",
+		    (uint32_t)atomic_get(&head) - (uint32_t)atomic_get(&tail),
+		    (uint32_t)atomic_get(&stat_posted),
+		    (uint32_t)atomic_get(&stat_high_water));
+	shell_print(shell,
+		    "events dropped: %u, overwritten: %u, too long: %u",
+		    (uint32_t)atomic_get(&stat_dropped),
+		    (uint32_t)atomic_get(&stat_overwritten),
+		    (uint32_t)atomic_get(&stat_too_long));
+}
+#endif
@@ -1,6 +1,7 @@
 #include "main.h"
 
 #include <fatal.h>
+#include <stdlib.h>
 #include <sys/reboot.h>
 #include <usb/usb_device.h>
 #ifdef CONFIG_SHELL
@@ -57,8 +58,148 @@ static int cmd_main_stop(const struct shell *shell, size_t argc, char **argv)
 	return 0;
 }
 
+static int cmd_main_status(const struct shell *shell, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	main_bt_print_status(shell);
+	main_peer_print_poll_stats(shell);
+	main_event_print_stats(shell);
+	main_store_print_stats(shell);
+	main_state_print_stats(shell);
+	main_mqtt_print_stats(shell);
+
+	return 0;
+}
+
+static int cmd_main_payload(const struct shell *shell, size_t argc, char **argv)
+{
+	if (argc < 2) {
+		shell_print(shell, "%s", main_mqtt_binary() ? "bin" : "hex");
+		return 0;
+	}
+
+	if (!strcmp(argv[1], "hex")) {
+		main_mqtt_set_binary(false);
+	} else if (!strcmp(argv[1], "bin")) {
+		main_mqtt_set_binary(true);
+	} else {
+		shell_error(shell, "unknown payload format: %s", argv[1]);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int cmd_main_conn(const struct shell *shell, size_t argc, char **argv)
+{
+	struct bt_le_conn_param param;
+	const struct bt_le_conn_param *current;
+	bt_addr_le_t addr;
+	int err;
+
+	err = bt_addr_le_from_str(argv[1], "random", &addr);
+	if (err) {
+		shell_error(shell, "invalid address: %s", argv[1]);
+		return err;
+	}
+
+	if (argc == 2) {
+		current = main_peer_conn_param(main_peer_find(&addr));
+		shell_print(shell,
+			    "interval %u-%u, latency %u, timeout %u",
+			    current->interval_min,
+			    current->interval_max,
+			    current->latency,
+			    current->timeout);
+		return 0;
+	}
+
+	if (argc == 3) {
+		err = main_peer_conn_profile(argv[2], &param);
+		if (err) {
+			shell_error(shell, "unknown profile: %s", argv[2]);
+			return err;
+		}
+	} else if (argc == 6) {
+		param.interval_min = strtoul(argv[2], NULL, 0);
+		param.interval_max = strtoul(argv[3], NULL, 0);
+		param.latency = strtoul(argv[4], NULL, 0);
+		param.timeout = strtoul(argv[5], NULL, 0);
+	} else {
+		shell_error(shell, "expected a profile or all four parameters");
+		return -EINVAL;
+	}
+
+	err = main_peer_set_conn_param(&addr, &param);
+	if (err) {
+		shell_error(shell, "failed to set connection parameters: %d", err);
+	}
+
+	return err;
+}
+
+static int cmd_main_poll(const struct shell *shell, size_t argc, char **argv)
+{
+	bt_addr_le_t addr;
+	bool polled;
+	int err;
+
+	err = bt_addr_le_from_str(argv[1], "random", &addr);
+	if (err) {
+		shell_error(shell, "invalid address: %s", argv[1]);
+		return err;
+	}
+
+	if (argc < 3) {
+		const struct main_peer *peer = main_peer_find(&addr);
+
+		shell_print(shell, "%s", (peer && peer->polled) ? "on" : "off");
+		return 0;
+	}
+
+	if (!strcmp(argv[2], "on")) {
+		polled = true;
+	} else if (!strcmp(argv[2], "off")) {
+		polled = false;
+	} else {
+		shell_error(shell, "expected on or off: %s", argv[2]);
+		return -EINVAL;
+	}
+
+	err = main_peer_set_polled(&addr, polled);
+	if (err) {
+		shell_error(shell, "failed to change polling: %d", err);
+	}
+
+	return err;
+}
+
 SHELL_STATIC_SUBCMD_SET_CREATE(sub_main,
 			       SHELL_CMD(stop, NULL, "stop autoinit", cmd_main_stop),
+			       SHELL_CMD(status, NULL, "print connection status", cmd_main_status),
+			       SHELL_CMD_ARG(payload,
+					     NULL,
+					     "payload format of published values: [hex|bin]",
+					     cmd_main_payload,
+					     1,
+					     1),
+			       SHELL_CMD_ARG(conn,
+					     NULL,
+					     "connection parameters of a device: <addr> "
+					     "[default|fast|lowpower|"
+					     "<min> <max> <latency> <timeout>]",
+					     cmd_main_conn,
+					     2,
+					     4),
+			       SHELL_CMD_ARG(poll,
+					     NULL,
+					     "connect a device only from time to time: "
+					     "<addr> [on|off]",
+					     cmd_main_poll,
+					     2,
+					     1),
 			       SHELL_SUBCMD_SET_END /* Array terminated. */
 );
 SHELL_CMD_REGISTER(main, &sub_main, "main", NULL);
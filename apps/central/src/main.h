@@ -3,18 +3,212 @@
 
 #include <bluetooth/addr.h>
 #include <bluetooth/conn.h>
+#include <net/mqtt.h>
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
+
+struct main_gatt_chrc {
+	uint16_t value_handle;
+	/* 0 if the characteristic has no CCC */
+	uint16_t ccc_handle;
+	uint8_t properties;
+};
+
+/* discovery result, stored as-is in settings */
+struct main_gatt_cache {
+	uint8_t db_hash[16];
+	uint8_t num_chrcs;
+	struct main_gatt_chrc chrcs[CONFIG_CENTRAL_GATT_MAX_CHRCS];
+};
+
+/* "MAC/", the topic tree in front of it depends on the payload format */
+#define MAIN_TOPIC_PREFIX_LEN (BT_ADDR_STR_LEN - 1 + 1)
+/* "HANDLE/state" */
+#define MAIN_TOPIC_SUFFIX_LEN (sizeof("0000/state") - 1)
+
+/* for events which don't belong to a subscribed characteristic */
+#define MAIN_EVENT_CHRC_UNKNOWN 0xff
+
+enum main_event_type {
+	MAIN_EVENT_CHARACTERISTIC_VALUE,
+	MAIN_EVENT_CONNECTION_STATUS,
+	/* one byte, enum main_phy */
+	MAIN_EVENT_PHY,
+};
+
+/* ordered by data rate, published in MAIN_EVENT_PHY */
+enum main_phy {
+	MAIN_PHY_CODED_S8,
+	MAIN_PHY_CODED_S2,
+	MAIN_PHY_1M,
+	MAIN_PHY_2M,
+};
+
+/* something to publish, passed from the BT stack to the MQTT thread */
+struct main_event {
+	/* k_uptime_get_32() when it was posted */
+	uint32_t timestamp;
+	bt_addr_t addr;
+	uint8_t type;
+	/* index of the characteristic in the topic cache of the connection */
+	uint8_t chrc;
+	/* answers a read, published even if the value didn't change */
+	bool solicited;
+	uint16_t handle;
+	uint16_t len;
+	uint8_t data[CONFIG_CENTRAL_EVENT_MAX_LEN];
+};
+
+/* values of the placeholders in a topic */
+struct main_topic_args {
+	bt_addr_t addr;
+	uint16_t handle;
+};
+
+/* flags for main_set_bluetooth_value() */
+#define MAIN_WRITE_WITHOUT_RESPONSE BIT(0)
+/* held back until main_flush_bluetooth_values() */
+#define MAIN_WRITE_BATCH BIT(1)
+
+struct main_topic_route;
+
+typedef int (*main_topic_handler_t)(const struct main_topic_route *route,
+				    const struct main_topic_args *args,
+				    size_t len);
+
+struct main_topic_route {
+	/* segments separated by '/', {mac} and {handle} match a device address and handle */
+	const char *pattern;
+	main_topic_handler_t handler;
+	/* for the handler */
+	uintptr_t arg;
+	/* the payload is raw bytes instead of a hex string */
+	bool binary;
+};
+
+/* everything we remember about a bonded device across connections */
+struct main_peer {
+	bool used;
+	bt_addr_le_t addr;
+
+	bool gatt_valid;
+	struct main_gatt_cache gatt;
+
+	/* stored in settings, the default profile is used if not set */
+	bool conn_param_valid;
+	struct bt_le_conn_param conn_param;
+
+	/* failed connection attempts in a row, reset once the setup completes */
+	uint8_t connect_failures;
+	/* uptime before which advertisements of the device are ignored */
+	int64_t next_connect;
+
+	/* steps below MAIN_PHY_2M the link may use, raised when a faster PHY lost it */
+	uint8_t phy_backoff;
+
+	/* stored in settings, connected only every CONFIG_CENTRAL_POLL_INTERVAL */
+	bool polled;
+	/* uptime from which on the device should be connected again */
+	int64_t poll_due;
+	/* uptime when the device was last seen advertising while due */
+	int64_t poll_seen;
+	/* uptime of the end of the last completed poll */
+	int64_t last_poll;
+	uint32_t polls;
+	/* how long after poll_due the device got connected */
+	int64_t poll_lag_last;
+	int64_t poll_lag_max;
+
+	/* sends its values in advertisements, isn't connected */
+	bool broadcast;
+	/* of the last broadcast which got published */
+	uint32_t broadcast_counter;
+};
 
 void main_init_bluetooth(void);
 void main_init_mqtt(void);
 
-int main_publish_characteristic_value(const char *addr,
-				      uint16_t handle,
-				      const void *data,
-				      size_t data_len);
-int main_publish_connection_status(const char *addr, bool connected);
+int main_publish_connection_status(const bt_addr_t *addr, bool connected);
+int main_publish_phy(const bt_addr_t *addr, enum main_phy phy);
+void main_mqtt_topic_prefix(const bt_addr_t *addr, char *buf);
+void main_mqtt_topic_suffix(uint16_t handle, char *buf);
+void main_mqtt_set_binary(bool binary);
+bool main_mqtt_binary(void);
 
 bool main_bt_conn_is_connected(struct bt_conn *conn);
-int main_set_bluetooth_value(const bt_addr_t *addr, uint16_t handle, void *data, size_t len);
+int main_bt_bond_ltk(const bt_addr_le_t *addr, uint8_t ltk[16]);
+bool main_broadcast_handle(const bt_addr_le_t *addr, struct net_buf_simple *ad);
+void main_broadcast_bonded(const bt_addr_le_t *addr);
+bool main_bt_is_bonded(const bt_addr_le_t *addr);
+bool main_bt_is_connecting(const bt_addr_le_t *addr);
+int main_bt_update_conn_param(const bt_addr_le_t *addr);
+bool main_bt_topic_cache(const bt_addr_t *addr,
+			 uint8_t chrc,
+			 uint16_t handle,
+			 const char **prefix,
+			 const char **suffix);
+void *main_bt_value_alloc(size_t len, uint32_t flags);
+void main_bt_value_free(void *data);
+int main_set_bluetooth_value(const bt_addr_t *addr,
+			     uint16_t handle,
+			     void *data,
+			     size_t len,
+			     uint32_t flags);
+int main_read_bluetooth_value(const bt_addr_t *addr, uint16_t handle);
+bool main_bt_value_cached(const bt_addr_t *addr, uint16_t handle, struct main_event *evt);
+int main_flush_bluetooth_values(const bt_addr_t *addr);
 void main_publish_all_connection_statuses(void);
 
+int main_event_init(void);
+int main_event_wakeup_fd(void);
+void main_event_clear_wakeup(void);
+bool main_event_get(struct main_event *evt);
+int main_event_post_characteristic_value(const bt_addr_t *addr,
+					 uint16_t handle,
+					 uint8_t chrc,
+					 const void *data,
+					 size_t data_len,
+					 bool solicited);
+int main_event_post_connection_status(const bt_addr_t *addr, bool connected);
+int main_event_post_phy(const bt_addr_t *addr, enum main_phy phy);
+
+void main_store_init(void);
+bool main_store_empty(void);
+void main_store_put(const struct main_event *evt);
+bool main_store_peek(struct main_event *evt);
+void main_store_pop(void);
+
+bool main_state_is_duplicate(const struct main_event *evt);
+void main_state_update(const struct main_event *evt);
+bool main_state_get(size_t *pos, struct main_event *evt);
+
+const struct main_topic_route *main_topic_route(const struct main_topic_route *routes,
+						size_t num_routes,
+						const struct mqtt_utf8 *topic,
+						struct main_topic_args *args);
+int main_topic_filter(const struct main_topic_route *route, char *buf, size_t bufsize);
+
+struct main_peer *main_peer_find(const bt_addr_le_t *addr);
+struct main_peer *main_peer_get(const bt_addr_le_t *addr);
+int main_peer_store_gatt(const struct main_peer *peer);
+void main_peer_sync_bonds(void);
+int main_peer_conn_profile(const char *name, struct bt_le_conn_param *param);
+const struct bt_le_conn_param *main_peer_conn_param(const struct main_peer *peer);
+int main_peer_set_conn_param(const bt_addr_le_t *addr, const struct bt_le_conn_param *param);
+int main_peer_set_polled(const bt_addr_le_t *addr, bool polled);
+size_t main_peer_num_polled(void);
+size_t main_peer_num_due(int64_t now, int64_t *next_due);
+const struct main_peer *main_peer_next_poll(int64_t now);
+size_t main_peer_num_broadcasting(void);
+
+#ifdef CONFIG_SHELL
+void main_bt_print_status(const struct shell *shell);
+void main_peer_print_poll_stats(const struct shell *shell);
+void main_event_print_stats(const struct shell *shell);
+void main_store_print_stats(const struct shell *shell);
+void main_state_print_stats(const struct shell *shell);
+void main_mqtt_print_stats(const struct shell *shell);
+#endif
+
 #endif /* MAIN_H */
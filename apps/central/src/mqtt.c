@@ -5,9 +5,12 @@
 #include <net/net_if.h>
 #include <net/net_mgmt.h>
 #include <net/socket.h>
-#include <random/rand32.h>
 #include <stdio.h>
+#include <sys/atomic.h>
 #include <sys/util.h>
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
 
 #include "main.h"
 
@@ -17,18 +20,60 @@ LOG_MODULE_REGISTER(main_mqtt, LOG_LEVEL_DBG);
 #define APP_RECV_TIMEOUT_MS 2000
 #define APP_CONNECT_TIMEOUT_MS 2000
 #define APP_SLEEP_MSECS 500
-#define APP_MQTT_BUFFER_SIZE 128
 #define MQTT_CLIENTID "zephyr_publisher"
+#define PUBLISH_QOS MQTT_QOS_1_AT_LEAST_ONCE
+#define TOPIC_ROOT_HEX "bluetooth/"
+#define TOPIC_ROOT_BIN "bluetooth-bin/"
+#define TOPIC_CONNECTED "connected"
+#define TOPIC_PHY "phy"
+/* longest topic: the binary root, a device and a characteristic */
+#define TOPIC_MAX_LEN (sizeof(TOPIC_ROOT_BIN) - 1 + MAIN_TOPIC_PREFIX_LEN + MAIN_TOPIC_SUFFIX_LEN)
+
+/* indices into mqtt_data.fds */
+#define FD_MQTT 0
+#define FD_EVENTS 1
 
 static struct net_mgmt_event_callback mgmt_cb;
+/* publish raw bytes below TOPIC_ROOT_BIN instead of hex strings, set from the shell */
+static atomic_t payload_binary;
 static K_THREAD_STACK_DEFINE(mqtt_stack_area, 4096);
 static struct k_thread mqtt_thread_data;
-static char topic_buf[PATH_MAX];
-static char publish_data_buf[APP_MQTT_BUFFER_SIZE];
+static uint8_t topic_buf[TOPIC_MAX_LEN];
+static char publish_data_buf[CONFIG_CENTRAL_EVENT_MAX_LEN * 2 + 1];
+
+enum inflight_state {
+	INFLIGHT_FREE,
+	INFLIGHT_WAIT_PUBACK,
+	INFLIGHT_WAIT_PUBREC,
+	INFLIGHT_WAIT_PUBCOMP,
+};
+
+/* a publish the broker didn't acknowledge yet */
+struct inflight {
+	enum inflight_state state;
+	uint16_t message_id;
+	uint8_t retries;
+	int64_t first_sent;
+	int64_t last_sent;
+	struct main_event evt;
+};
+
+static struct inflight inflight[CONFIG_CENTRAL_MQTT_MAX_INFLIGHT];
+/* cached values for get requests, waiting to be published */
+static struct main_event replies[4];
+static size_t num_replies;
+static struct inflight_stats {
+	uint32_t acked;
+	uint32_t retransmitted;
+	uint32_t expired;
+	uint32_t latency_min;
+	uint32_t latency_max;
+	uint64_t latency_sum;
+} inflight_stats;
 static struct mqtt_data {
 	/* Buffers for MQTT client. */
-	uint8_t rx_buffer[APP_MQTT_BUFFER_SIZE];
-	uint8_t tx_buffer[APP_MQTT_BUFFER_SIZE];
+	uint8_t rx_buffer[CONFIG_CENTRAL_MQTT_RX_BUFFER_SIZE];
+	uint8_t tx_buffer[CONFIG_CENTRAL_MQTT_TX_BUFFER_SIZE];
 
 	/* The mqtt client struct */
 	struct mqtt_client client_ctx;
@@ -36,22 +81,32 @@ static struct mqtt_data {
 	/* MQTT Broker details. */
 	struct sockaddr_storage broker;
 
-	struct zsock_pollfd fds[1];
+	struct zsock_pollfd fds[2];
 	int nfds;
 
 	bool connected;
+	/* uptime at which the next burst of stored events may be published */
+	int64_t next_replay;
+	/* last used message id, 0 is not a valid one */
+	uint16_t message_id;
 } mqtt_data;
 
 static void prepare_fds(struct mqtt_client *client)
 {
 	if (client->transport.type == MQTT_TRANSPORT_NON_SECURE) {
-		mqtt_data.fds[0].fd = client->transport.tcp.sock;
+		mqtt_data.fds[FD_MQTT].fd = client->transport.tcp.sock;
 	} else {
 		LOG_WRN("unsupported mqtt transport type: %d", client->transport.type);
 	}
 
-	mqtt_data.fds[0].events = ZSOCK_POLLIN;
+	mqtt_data.fds[FD_MQTT].events = ZSOCK_POLLIN;
 	mqtt_data.nfds = 1;
+
+	mqtt_data.fds[FD_EVENTS].fd = main_event_wakeup_fd();
+	mqtt_data.fds[FD_EVENTS].events = ZSOCK_POLLIN;
+	if (mqtt_data.fds[FD_EVENTS].fd >= 0) {
+		mqtt_data.nfds++;
+	}
 }
 
 static void clear_fds(void)
@@ -59,12 +114,13 @@ static void clear_fds(void)
 	mqtt_data.nfds = 0;
 }
 
-static int wait(int timeout)
+static int wait(int timeout, bool with_events)
 {
 	int ret = 0;
+	int nfds = with_events ? mqtt_data.nfds : MIN(mqtt_data.nfds, 1);
 
-	if (mqtt_data.nfds > 0) {
-		ret = zsock_poll(mqtt_data.fds, mqtt_data.nfds, timeout);
+	if (nfds > 0) {
+		ret = zsock_poll(mqtt_data.fds, nfds, timeout);
 		if (ret < 0) {
 			LOG_ERR("poll error: %d", errno);
 		}
@@ -73,6 +129,119 @@ static int wait(int timeout)
 	return ret;
 }
 
+static struct inflight *inflight_find(uint16_t message_id, enum inflight_state state)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(inflight); i++) {
+		if (inflight[i].state == state && inflight[i].message_id == message_id) {
+			return &inflight[i];
+		}
+	}
+
+	return NULL;
+}
+
+static bool message_id_in_use(uint16_t message_id)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(inflight); i++) {
+		if (inflight[i].state != INFLIGHT_FREE && inflight[i].message_id == message_id) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static uint16_t message_id_next(void)
+{
+	do {
+		mqtt_data.message_id++;
+	} while (mqtt_data.message_id == 0 || message_id_in_use(mqtt_data.message_id));
+
+	return mqtt_data.message_id;
+}
+
+static void inflight_complete(struct inflight *slot)
+{
+	uint32_t latency = k_uptime_get() - slot->first_sent;
+
+	if (inflight_stats.acked == 0 || latency < inflight_stats.latency_min) {
+		inflight_stats.latency_min = latency;
+	}
+	inflight_stats.latency_max = MAX(inflight_stats.latency_max, latency);
+	inflight_stats.latency_sum += latency;
+	inflight_stats.acked++;
+
+	slot->state = INFLIGHT_FREE;
+}
+
+/* wait for an acknowledgement if the window is full */
+static struct inflight *inflight_alloc(void)
+{
+	int64_t deadline = k_uptime_get() + APP_RECV_TIMEOUT_MS;
+	int64_t left;
+	size_t i;
+
+	for (;;) {
+		for (i = 0; i < ARRAY_SIZE(inflight); i++) {
+			if (inflight[i].state == INFLIGHT_FREE) {
+				return &inflight[i];
+			}
+		}
+
+		left = deadline - k_uptime_get();
+		if (!mqtt_data.connected || left <= 0) {
+			LOG_WRN("too many unacknowledged publishes");
+			return NULL;
+		}
+
+		if (wait(left, false) > 0 && mqtt_input(&mqtt_data.client_ctx)) {
+			return NULL;
+		}
+	}
+}
+
+/* values which didn't make it are replayed after reconnecting */
+static void inflight_flush(void)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(inflight); i++) {
+		if (inflight[i].state == INFLIGHT_FREE) {
+			continue;
+		}
+
+		if (inflight[i].evt.type == MAIN_EVENT_CHARACTERISTIC_VALUE) {
+			main_store_put(&inflight[i].evt);
+		}
+
+		inflight[i].state = INFLIGHT_FREE;
+	}
+}
+
+/* uptime at which the oldest unacknowledged publish has to be sent again, -1 if none */
+static int64_t inflight_next_retransmit(void)
+{
+	int64_t next = -1;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(inflight); i++) {
+		int64_t t = inflight[i].last_sent + CONFIG_CENTRAL_MQTT_RETRY_TIMEOUT;
+
+		if (inflight[i].state != INFLIGHT_FREE && (next < 0 || t < next)) {
+			next = t;
+		}
+	}
+
+	return next;
+}
+
+/* what's left of the payload of the publish being handled */
+static size_t payload_left;
+
 static int read_payload(void *data_, size_t len)
 {
 	int ret;
@@ -81,7 +250,7 @@ static int read_payload(void *data_, size_t len)
 	while (len) {
 		ret = mqtt_read_publish_payload(&mqtt_data.client_ctx, data, MIN(len, INT_MAX));
 		if (ret == -EAGAIN) {
-			ret = wait(APP_RECV_TIMEOUT_MS);
+			ret = wait(APP_RECV_TIMEOUT_MS, false);
 			if (ret == 0) {
 				LOG_ERR("publish payload receive timeout");
 				return -ETIMEDOUT;
@@ -97,136 +266,164 @@ static int read_payload(void *data_, size_t len)
 
 		data += ret;
 		len -= ret;
+		payload_left -= ret;
 	}
 
 	return 0;
 }
 
-static int get_path_segment(const struct mqtt_utf8 *path, size_t n, struct mqtt_utf8 *out)
+/* the value is decoded chunk by chunk straight into the request buffer */
+static int handle_set(const struct main_topic_route *route,
+		      const struct main_topic_args *args,
+		      size_t len)
 {
-	const uint8_t *utf8 = path->utf8;
-	uint32_t size = path->size;
+	static char hex[64];
+	size_t binlen = route->binary ? len : len / 2;
+	size_t pos = 0;
+	size_t toread;
+	uint8_t *data;
+	int ret = 0;
 
-	while (n) {
-		if (size == 0) {
-			return -ENOENT;
-		}
-		if (*utf8 == '/') {
-			n--;
-		}
+	if (!route->binary && len % 2) {
+		LOG_ERR("hex payload of odd length");
+		return -EINVAL;
+	}
 
-		utf8++;
-		size--;
+	if (binlen == 0 || binlen > CONFIG_CENTRAL_GATT_WRITE_MAX_LEN) {
+		LOG_ERR("can't write %zu bytes", binlen);
+		return -EINVAL;
 	}
 
-	out->utf8 = utf8;
+	data = main_bt_value_alloc(binlen, route->arg);
+	if (!data) {
+		return -EBUSY;
+	}
 
-	for (out->size = 0; utf8[out->size] != '/'; out->size++) {
+	if (route->binary) {
+		ret = read_payload(data, binlen);
 	}
 
-	return 0;
-}
+	while (!route->binary && !ret && pos < binlen) {
+		toread = MIN((binlen - pos) * 2, sizeof(hex));
 
-static void handle_publish(int result, const struct mqtt_publish_param *param)
-{
-	const struct mqtt_publish_message *message = &param->message;
-	struct mqtt_puback_param puback;
-	struct mqtt_pubrec_param pubrec;
-	static char data[APP_MQTT_BUFFER_SIZE];
-	static char rawdata[APP_MQTT_BUFFER_SIZE];
-	int ret;
-	struct mqtt_utf8 mac;
-	struct mqtt_utf8 handle;
-	char mac0[BT_ADDR_STR_LEN];
-	bt_addr_t btaddr;
-	char handle0[5];
-	unsigned long handle_ul;
-	size_t binlen;
+		ret = read_payload(hex, toread);
+		if (!ret && !hex2bin(hex, toread, data + pos, binlen - pos)) {
+			LOG_ERR("can't convert payload from hex");
+			ret = -EINVAL;
+		}
+		pos += toread / 2;
+	}
 
-	LOG_INF("MQTT publish received %d, %u bytes", result, message->payload.len);
-	LOG_INF(" id: %d, qos: %d", param->message_id, message->topic.qos);
-	LOG_HEXDUMP_DBG(message->topic.topic.utf8, message->topic.topic.size, "topic");
+	if (ret) {
+		main_bt_value_free(data);
+		return ret;
+	}
 
-	if (message->payload.len > sizeof(data)) {
-		uint32_t len = message->payload.len;
+	LOG_HEXDUMP_DBG(data, binlen, "payload");
 
-		LOG_WRN("message payload is too big, discard");
+	return main_set_bluetooth_value(&args->addr, args->handle, data, binlen, route->arg);
+}
 
-		while (len) {
-			size_t toread = MIN(len, sizeof(data));
+/* the payload doesn't matter */
+static int handle_read(const struct main_topic_route *route,
+		       const struct main_topic_args *args,
+		       size_t len)
+{
+	return main_read_bluetooth_value(&args->addr, args->handle);
+}
 
-			ret = read_payload(data, toread);
-			if (ret) {
-				LOG_ERR("can't read payload: %d", ret);
-				return;
-			}
+/* answered from the cache if possible, repeated gets share one read */
+static int handle_get(const struct main_topic_route *route,
+		      const struct main_topic_args *args,
+		      size_t len)
+{
+	// publishing from within mqtt_input() isn't possible, publish_replies() does it
+	if (num_replies < ARRAY_SIZE(replies) &&
+	    main_bt_value_cached(&args->addr, args->handle, &replies[num_replies])) {
+		LOG_INF("Answering get of %04x from cache", args->handle);
+		num_replies++;
+		return 0;
+	}
 
-			len -= toread;
-		}
+	return main_read_bluetooth_value(&args->addr, args->handle);
+}
 
-		goto ack;
-	}
+static int handle_flush(const struct main_topic_route *route,
+			 const struct main_topic_args *args,
+			 size_t len)
+{
+	return main_flush_bluetooth_values(&args->addr);
+}
 
-	ret = read_payload(data, message->payload.len);
-	if (ret) {
-		LOG_ERR("can't read payload: %d", ret);
-		return;
-	}
+static const struct main_topic_route routes[] = {
+	{ TOPIC_ROOT_HEX "{mac}/{handle}/set", handle_set, 0, false },
+	{ TOPIC_ROOT_HEX "{mac}/{handle}/set_nr", handle_set, MAIN_WRITE_WITHOUT_RESPONSE, false },
+	{ TOPIC_ROOT_HEX "{mac}/{handle}/set_batch", handle_set, MAIN_WRITE_BATCH, false },
+	{ TOPIC_ROOT_HEX "{mac}/{handle}/read", handle_read, 0, false },
+	{ TOPIC_ROOT_HEX "{mac}/{handle}/get", handle_get, 0, false },
+	{ TOPIC_ROOT_HEX "{mac}/flush", handle_flush, 0, false },
+	{ TOPIC_ROOT_BIN "{mac}/{handle}/set", handle_set, 0, true },
+	{ TOPIC_ROOT_BIN "{mac}/{handle}/set_nr", handle_set, MAIN_WRITE_WITHOUT_RESPONSE, true },
+	{ TOPIC_ROOT_BIN "{mac}/{handle}/set_batch", handle_set, MAIN_WRITE_BATCH, true },
+	{ TOPIC_ROOT_BIN "{mac}/{handle}/read", handle_read, 0, true },
+	{ TOPIC_ROOT_BIN "{mac}/{handle}/get", handle_get, 0, true },
+	{ TOPIC_ROOT_BIN "{mac}/flush", handle_flush, 0, true },
+};
+
+/* read and forget the rest of a payload */
+static int discard_payload(size_t len)
+{
+	static uint8_t buf[32];
+	size_t toread;
+	int ret;
 
-	LOG_HEXDUMP_DBG(data, message->payload.len, "payload");
+	while (len) {
+		toread = MIN(len, sizeof(buf));
 
-	binlen = hex2bin(data, message->payload.len, rawdata, ARRAY_SIZE(rawdata));
-	if (!binlen) {
-		LOG_ERR("can't convert payload from hex: %d", ret);
-		return;
-	}
+		ret = read_payload(buf, toread);
+		if (ret) {
+			return ret;
+		}
 
-	ret = get_path_segment(&message->topic.topic, 1, &mac);
-	if (ret) {
-		LOG_ERR("can't get mac from topic");
-		goto ack;
+		len -= toread;
 	}
 
-	ret = get_path_segment(&message->topic.topic, 2, &handle);
-	if (ret) {
-		LOG_ERR("can't get handle from topic");
-		goto ack;
-	}
+	return 0;
+}
+
+/* handlers read the payload themselves, whatever they leave is discarded */
+static void handle_publish(int result, const struct mqtt_publish_param *param)
+{
+	const struct mqtt_publish_message *message = &param->message;
+	struct mqtt_puback_param puback;
+	struct mqtt_pubrec_param pubrec;
+	int ret;
+	const struct main_topic_route *route;
+	struct main_topic_args args;
 
-	LOG_HEXDUMP_DBG(mac.utf8, mac.size, "mac");
-	LOG_HEXDUMP_DBG(handle.utf8, handle.size, "handle");
+	LOG_INF("MQTT publish received %d, %u bytes", result, message->payload.len);
+	LOG_INF(" id: %d, qos: %d", param->message_id, message->topic.qos);
+	LOG_HEXDUMP_DBG(message->topic.topic.utf8, message->topic.topic.size, "topic");
 
-	if (mac.size != sizeof(mac0) - 1) {
-		LOG_ERR("invalid mac length");
-		goto ack;
-	}
-	memcpy(mac0, mac.utf8, mac.size);
-	mac0[mac.size] = 0;
+	payload_left = message->payload.len;
 
-	if (handle.size != sizeof(handle0) - 1) {
-		LOG_ERR("invalid handle length");
-		goto ack;
+	route = main_topic_route(routes, ARRAY_SIZE(routes), &message->topic.topic, &args);
+	if (!route) {
+		LOG_ERR("no route for topic");
+		goto discard;
 	}
-	memcpy(handle0, handle.utf8, handle.size);
-	handle0[handle.size] = 0;
 
-	ret = bt_addr_from_str(mac0, &btaddr);
+	// handlers see empty payloads too
+	ret = route->handler(route, &args, payload_left);
 	if (ret) {
-		LOG_ERR("can't parse bluetooth addr");
-		goto ack;
-	}
-
-	errno = 0;
-	handle_ul = strtoul(handle0, NULL, 16);
-	if (handle_ul == 0 || handle_ul == ULONG_MAX || errno) {
-		LOG_ERR("can't parse handle: %d", errno);
-		goto ack;
+		LOG_ERR("can't handle %s: %d", route->pattern, ret);
 	}
 
-	ret = main_set_bluetooth_value(&btaddr, handle_ul, rawdata, binlen);
+discard:
+	ret = discard_payload(payload_left);
 	if (ret) {
-		LOG_ERR("can't set value: %d", ret);
-		goto ack;
+		LOG_ERR("can't read payload: %d", ret);
+		return;
 	}
 
 ack:
@@ -261,6 +458,7 @@ ack:
 static void mqtt_evt_handler(struct mqtt_client *const client, const struct mqtt_evt *evt)
 {
 	int err;
+	struct inflight *slot;
 
 	switch (evt->type) {
 	case MQTT_EVT_CONNACK:
@@ -294,6 +492,11 @@ static void mqtt_evt_handler(struct mqtt_client *const client, const struct mqtt
 
 		LOG_INF("PUBACK packet id: %u", evt->param.puback.message_id);
 
+		slot = inflight_find(evt->param.puback.message_id, INFLIGHT_WAIT_PUBACK);
+		if (slot) {
+			inflight_complete(slot);
+		}
+
 		break;
 
 	case MQTT_EVT_PUBREC:
@@ -304,6 +507,13 @@ static void mqtt_evt_handler(struct mqtt_client *const client, const struct mqtt
 
 		LOG_INF("PUBREC packet id: %u", evt->param.pubrec.message_id);
 
+		slot = inflight_find(evt->param.pubrec.message_id, INFLIGHT_WAIT_PUBREC);
+		if (slot) {
+			slot->state = INFLIGHT_WAIT_PUBCOMP;
+			slot->retries = 0;
+			slot->last_sent = k_uptime_get();
+		}
+
 		const struct mqtt_pubrel_param rel_param = { .message_id =
 								     evt->param.pubrec.message_id };
 
@@ -341,6 +551,11 @@ static void mqtt_evt_handler(struct mqtt_client *const client, const struct mqtt
 
 		LOG_INF("PUBCOMP packet id: %u", evt->param.pubcomp.message_id);
 
+		slot = inflight_find(evt->param.pubcomp.message_id, INFLIGHT_WAIT_PUBCOMP);
+		if (slot) {
+			inflight_complete(slot);
+		}
+
 		break;
 
 	case MQTT_EVT_SUBACK:
@@ -403,28 +618,356 @@ static int init_broker(void)
 static void subscribe(void)
 {
 	int err;
-	const char *topic = "bluetooth/+/+/set";
-	struct mqtt_topic subs_topic = { .topic = { .utf8 = topic, .size = strlen(topic) },
-					 .qos = MQTT_QOS_2_EXACTLY_ONCE };
-	const struct mqtt_subscription_list subs_list = { .list = &subs_topic,
-							  .list_count = 1U,
-							  .message_id = 1U };
+	static char filters[ARRAY_SIZE(routes)][64];
+	struct mqtt_topic subs_topics[ARRAY_SIZE(routes)];
+	size_t i;
+	int len;
+	const struct mqtt_subscription_list subs_list = { .list = subs_topics,
+							  .list_count = ARRAY_SIZE(subs_topics),
+							  .message_id = message_id_next() };
+
+	for (i = 0; i < ARRAY_SIZE(routes); i++) {
+		len = main_topic_filter(&routes[i], filters[i], sizeof(filters[i]));
+		if (len < 0) {
+			LOG_ERR("invalid route %s: %d", routes[i].pattern, len);
+			return;
+		}
+
+		subs_topics[i].topic.utf8 = filters[i];
+		subs_topics[i].topic.size = len;
+		subs_topics[i].qos = MQTT_QOS_2_EXACTLY_ONCE;
+	}
 
 	err = mqtt_subscribe(&mqtt_data.client_ctx, &subs_list);
 	if (err) {
-		LOG_ERR("Failed to subscribe to %s item, error %d", subs_topic.topic.utf8, err);
+		LOG_ERR("Failed to subscribe, error %d", err);
 		return;
 	}
 
 	LOG_INF("subscription requested");
 }
 
+void main_mqtt_topic_prefix(const bt_addr_t *addr, char *buf)
+{
+	char str[BT_ADDR_STR_LEN];
+
+	bt_addr_to_str(addr, str, sizeof(str));
+	snprintf(buf, MAIN_TOPIC_PREFIX_LEN + 1, "%s/", str);
+}
+
+void main_mqtt_topic_suffix(uint16_t handle, char *buf)
+{
+	snprintf(buf, MAIN_TOPIC_SUFFIX_LEN + 1, "%04x/state", handle);
+}
+
+void main_mqtt_set_binary(bool binary)
+{
+	atomic_set(&payload_binary, binary);
+}
+
+bool main_mqtt_binary(void)
+{
+	return atomic_get(&payload_binary);
+}
+
+/* write the topic of an event to buf, returns its length */
+static int encode_topic(const struct main_event *evt, bool binary, uint8_t *buf, size_t bufsize)
+{
+	const char *root = binary ? TOPIC_ROOT_BIN : TOPIC_ROOT_HEX;
+	size_t root_len = strlen(root);
+	char prefix_buf[MAIN_TOPIC_PREFIX_LEN + 1];
+	char suffix_buf[MAIN_TOPIC_SUFFIX_LEN + 1];
+	const char *prefix;
+	const char *suffix;
+	size_t suffix_len;
+
+	switch (evt->type) {
+	case MAIN_EVENT_CHARACTERISTIC_VALUE:
+		suffix_len = MAIN_TOPIC_SUFFIX_LEN;
+		if (!main_bt_topic_cache(&evt->addr, evt->chrc, evt->handle, &prefix, &suffix)) {
+			main_mqtt_topic_suffix(evt->handle, suffix_buf);
+			suffix = suffix_buf;
+			prefix = NULL;
+		}
+		break;
+
+	case MAIN_EVENT_CONNECTION_STATUS:
+	case MAIN_EVENT_PHY:
+		suffix = (evt->type == MAIN_EVENT_PHY) ? TOPIC_PHY : TOPIC_CONNECTED;
+		suffix_len = strlen(suffix);
+		if (!main_bt_topic_cache(&evt->addr, MAIN_EVENT_CHRC_UNKNOWN, 0, &prefix, NULL)) {
+			prefix = NULL;
+		}
+		break;
+
+	default:
+		LOG_ERR("unknown event type %u", evt->type);
+		return -EINVAL;
+	}
+
+	// the connection is gone already, e.g. for stored values
+	if (!prefix) {
+		main_mqtt_topic_prefix(&evt->addr, prefix_buf);
+		prefix = prefix_buf;
+	}
+
+	if (root_len + MAIN_TOPIC_PREFIX_LEN + suffix_len > bufsize) {
+		return -ENOMEM;
+	}
+
+	memcpy(buf, root, root_len);
+	buf += root_len;
+	memcpy(buf, prefix, MAIN_TOPIC_PREFIX_LEN);
+	buf += MAIN_TOPIC_PREFIX_LEN;
+	memcpy(buf, suffix, suffix_len);
+
+	return root_len + MAIN_TOPIC_PREFIX_LEN + suffix_len;
+}
+
+static int publish_message(const struct main_event *evt, uint16_t message_id, bool dup)
+{
+	struct mqtt_publish_param param;
+	bool binary = main_mqtt_binary();
+	int topic_len;
+
+	topic_len = encode_topic(evt, binary, topic_buf, sizeof(topic_buf));
+	if (topic_len < 0) {
+		return topic_len;
+	}
+
+	// raw values go out as they are, without a copy
+	if (binary) {
+		param.message.payload.data = (uint8_t *)evt->data;
+		param.message.payload.len = evt->len;
+	} else if (evt->type == MAIN_EVENT_CONNECTION_STATUS) {
+		publish_data_buf[0] = '0';
+		publish_data_buf[1] = evt->data[0] ? '1' : '0';
+		param.message.payload.data = (uint8_t *)publish_data_buf;
+		param.message.payload.len = 2;
+	} else {
+		param.message.payload.data = (uint8_t *)publish_data_buf;
+		param.message.payload.len =
+			bin2hex(evt->data, evt->len, publish_data_buf, sizeof(publish_data_buf));
+		if (!param.message.payload.len) {
+			return -ENOMEM;
+		}
+	}
+
+	param.message.topic.qos = PUBLISH_QOS;
+	param.message.topic.topic.utf8 = topic_buf;
+	param.message.topic.topic.size = topic_len;
+	param.message_id = message_id;
+	param.dup_flag = dup;
+	param.retain_flag = 1U;
+
+	return mqtt_publish(&mqtt_data.client_ctx, &param);
+}
+
+static int publish_event(const struct main_event *evt)
+{
+	struct inflight *slot;
+	int rc;
+
+	if (!mqtt_data.connected) {
+		return -ENOTCONN;
+	}
+
+	slot = inflight_alloc();
+	if (!slot) {
+		return -EBUSY;
+	}
+
+	slot->evt = *evt;
+	slot->message_id = message_id_next();
+	slot->retries = 0;
+	slot->first_sent = k_uptime_get();
+	slot->last_sent = slot->first_sent;
+
+	rc = publish_message(&slot->evt, slot->message_id, false);
+	if (rc) {
+		return rc;
+	}
+
+	slot->state = (PUBLISH_QOS == MQTT_QOS_2_EXACTLY_ONCE) ? INFLIGHT_WAIT_PUBREC :
+								 INFLIGHT_WAIT_PUBACK;
+
+	if (evt->type == MAIN_EVENT_CHARACTERISTIC_VALUE) {
+		main_state_update(evt);
+	}
+
+	return 0;
+}
+
+/* send publishes again which weren't acknowledged in time */
+static void inflight_retransmit(void)
+{
+	struct inflight *slot;
+	int64_t now = k_uptime_get();
+	size_t i;
+	int rc;
+
+	for (i = 0; i < ARRAY_SIZE(inflight) && mqtt_data.connected; i++) {
+		slot = &inflight[i];
+
+		if (slot->state == INFLIGHT_FREE ||
+		    now - slot->last_sent < CONFIG_CENTRAL_MQTT_RETRY_TIMEOUT) {
+			continue;
+		}
+
+		if (slot->retries >= CONFIG_CENTRAL_MQTT_MAX_RETRIES) {
+			LOG_ERR("message %u was never acknowledged", slot->message_id);
+			inflight_stats.expired++;
+			slot->state = INFLIGHT_FREE;
+			continue;
+		}
+
+		LOG_WRN("retransmitting message %u", slot->message_id);
+
+		if (slot->state == INFLIGHT_WAIT_PUBCOMP) {
+			const struct mqtt_pubrel_param rel_param = { .message_id =
+									     slot->message_id };
+
+			rc = mqtt_publish_qos2_release(&mqtt_data.client_ctx, &rel_param);
+		} else {
+			rc = publish_message(&slot->evt, slot->message_id, true);
+		}
+		if (rc) {
+			LOG_ERR("retransmit failed: %d", rc);
+		}
+
+		slot->retries++;
+		slot->last_sent = now;
+		inflight_stats.retransmitted++;
+	}
+}
+
+/* keep values for later, connection statuses and PHYs get republished on connect anyway */
+static void store_event(const struct main_event *evt)
+{
+	if (evt->type == MAIN_EVENT_CHARACTERISTIC_VALUE) {
+		main_store_put(evt);
+	}
+}
+
+/* publish what the BT stack queued for us */
+static void publish_events(void)
+{
+	struct main_event evt;
+	int rc;
+
+	while (main_event_get(&evt)) {
+		// stay behind stored values, so they arrive in order
+		if (!mqtt_data.connected ||
+		    (evt.type == MAIN_EVENT_CHARACTERISTIC_VALUE && !main_store_empty())) {
+			store_event(&evt);
+			continue;
+		}
+
+		if (evt.type == MAIN_EVENT_CHARACTERISTIC_VALUE && main_state_is_duplicate(&evt)) {
+			continue;
+		}
+
+		rc = publish_event(&evt);
+		if (rc) {
+			LOG_ERR("failed to publish event: %d", rc);
+			store_event(&evt);
+		}
+	}
+}
+
+static void publish_replies(void)
+{
+	size_t i;
+	int rc;
+
+	for (i = 0; i < num_replies && mqtt_data.connected; i++) {
+		rc = publish_event(&replies[i]);
+		if (rc) {
+			LOG_ERR("failed to publish cached value: %d", rc);
+		}
+	}
+
+	num_replies = 0;
+}
+
+/* the broker might have lost its retained values, publish all we know */
+static void resync_state(void)
+{
+	struct main_event evt;
+	size_t pos = 0;
+	int rc;
+
+	while (mqtt_data.connected && main_state_get(&pos, &evt)) {
+		rc = publish_event(&evt);
+		if (rc) {
+			LOG_ERR("failed to republish value: %d", rc);
+		}
+	}
+}
+
+/* publish a few stored values at a time, so we don't flood the broker */
+static void replay_stored_events(void)
+{
+	struct main_event evt;
+	size_t i;
+	int rc;
+
+	if (main_store_empty() || k_uptime_get() < mqtt_data.next_replay) {
+		return;
+	}
+
+	mqtt_data.next_replay = k_uptime_get() + CONFIG_CENTRAL_STORE_REPLAY_INTERVAL;
+
+	for (i = 0; i < CONFIG_CENTRAL_STORE_REPLAY_BURST && mqtt_data.connected; i++) {
+		if (!main_store_peek(&evt)) {
+			LOG_INF("replay of stored events done");
+			break;
+		}
+
+		if (main_state_is_duplicate(&evt)) {
+			main_store_pop();
+			continue;
+		}
+
+		// keep it for the next attempt
+		rc = publish_event(&evt);
+		if (rc) {
+			LOG_ERR("failed to publish stored event: %d", rc);
+			break;
+		}
+
+		main_store_pop();
+	}
+}
+
+/* how long poll() may sleep without delaying the replay or a retransmission */
+static int time_left(int timeout)
+{
+	int64_t deadline = inflight_next_retransmit();
+	int64_t left;
+
+	if (!main_store_empty() && (deadline < 0 || mqtt_data.next_replay < deadline)) {
+		deadline = mqtt_data.next_replay;
+	}
+
+	if (deadline < 0) {
+		return timeout;
+	}
+
+	left = MAX(deadline - k_uptime_get(), 0);
+
+	return (timeout < 0) ? (int)left : MIN(timeout, (int)left);
+}
+
 static void connect_and_wait(void)
 {
 	int rc;
 	struct mqtt_client *client = &mqtt_data.client_ctx;
 
 	while (!mqtt_data.connected) {
+		// move values out of the small event queue while we can't publish them
+		publish_events();
+
 		rc = init_broker();
 		if (rc) {
 			LOG_ERR("failed to init broker: %d", rc);
@@ -441,7 +984,7 @@ static void connect_and_wait(void)
 
 		prepare_fds(client);
 
-		if (wait(APP_CONNECT_TIMEOUT_MS)) {
+		if (wait(APP_CONNECT_TIMEOUT_MS, false)) {
 			mqtt_input(client);
 		}
 
@@ -452,7 +995,16 @@ static void connect_and_wait(void)
 
 	LOG_INF("MQTT is now connected");
 	subscribe();
+	// events which queued up are older than the statuses we publish now
+	publish_events();
 	main_publish_all_connection_statuses();
+	// values stored while offline are newer, they follow with the replay
+	resync_state();
+
+	mqtt_data.next_replay = k_uptime_get();
+	if (!main_store_empty()) {
+		LOG_INF("replaying stored events");
+	}
 }
 
 static int mqtt_process_connection(void)
@@ -461,14 +1013,25 @@ static int mqtt_process_connection(void)
 	int rc;
 
 	while (mqtt_data.connected) {
-		if (wait(mqtt_keepalive_time_left(client))) {
-			rc = mqtt_input(client);
-			if (rc != 0) {
-				LOG_ERR("mqtt_input failed: %d", rc);
-				return rc;
+		if (wait(time_left(mqtt_keepalive_time_left(client)), true) > 0) {
+			if (mqtt_data.fds[FD_EVENTS].revents) {
+				main_event_clear_wakeup();
+			}
+
+			if (mqtt_data.fds[FD_MQTT].revents) {
+				rc = mqtt_input(client);
+				if (rc != 0) {
+					LOG_ERR("mqtt_input failed: %d", rc);
+					return rc;
+				}
 			}
 		}
 
+		inflight_retransmit();
+		publish_events();
+		publish_replies();
+		replay_stored_events();
+
 		rc = mqtt_live(client);
 		if (rc != 0 && rc != -EAGAIN) {
 			LOG_ERR("mqtt_live failed: %d", rc);
@@ -503,6 +1066,8 @@ static void mqtt_thread(void *_a, void *_b, void *_c)
 		} else {
 			mqtt_abort(client);
 		}
+
+		inflight_flush();
 	}
 }
 
@@ -561,6 +1126,9 @@ void main_init_mqtt(void)
 	/* MQTT transport configuration */
 	client->transport.type = MQTT_TRANSPORT_NON_SECURE;
 
+	main_event_init();
+	main_store_init();
+
 	net_mgmt_init_event_callback(&mgmt_cb, net_mgmt_handler, NET_EVENT_IPV4_ADDR_ADD);
 	net_mgmt_add_event_callback(&mgmt_cb);
 
@@ -578,70 +1146,61 @@ void main_init_mqtt(void)
 			K_NO_WAIT);
 }
 
-int main_publish_characteristic_value(const char *addr,
-				      uint16_t handle,
-				      const void *data,
-				      size_t data_len)
+int main_publish_connection_status(const bt_addr_t *addr, bool connected)
 {
-	struct mqtt_publish_param param;
-	int rc;
-	size_t hex_len;
+	struct main_event evt = {
+		.timestamp = k_uptime_get_32(),
+		.type = MAIN_EVENT_CONNECTION_STATUS,
+		.chrc = MAIN_EVENT_CHRC_UNKNOWN,
+		.len = 1,
+		.data = { connected },
+	};
 
-	if (!mqtt_data.connected) {
-		return -ENOTCONN;
-	}
+	bt_addr_copy(&evt.addr, addr);
 
-	rc = snprintf(topic_buf, sizeof(topic_buf), "bluetooth/%s/%04x/state", addr, handle);
-	if (rc < 0 || (size_t)rc >= sizeof(topic_buf)) {
-		return -ENOMEM;
-	}
+	return publish_event(&evt);
+}
 
-	hex_len = bin2hex(data, data_len, publish_data_buf, sizeof(publish_data_buf));
-	if (!hex_len) {
-		return -ENOMEM;
-	}
+int main_publish_phy(const bt_addr_t *addr, enum main_phy phy)
+{
+	struct main_event evt = {
+		.timestamp = k_uptime_get_32(),
+		.type = MAIN_EVENT_PHY,
+		.chrc = MAIN_EVENT_CHRC_UNKNOWN,
+		.len = 1,
+		.data = { phy },
+	};
 
-	param.message.topic.qos = MQTT_QOS_1_AT_LEAST_ONCE;
-	param.message.topic.topic.utf8 = (uint8_t *)topic_buf;
-	param.message.topic.topic.size = (size_t)rc;
-	param.message.payload.data = publish_data_buf;
-	param.message.payload.len = hex_len;
-	param.message_id = sys_rand32_get();
-	param.dup_flag = 0U;
-	param.retain_flag = 1U;
+	bt_addr_copy(&evt.addr, addr);
 
-	return mqtt_publish(&mqtt_data.client_ctx, &param);
+	return publish_event(&evt);
 }
 
-int main_publish_connection_status(const char *addr, bool connected)
+#ifdef CONFIG_SHELL
+void main_mqtt_print_stats(const struct shell *shell)
 {
-	struct mqtt_publish_param param;
-	int rc;
+	size_t pending = 0;
+	size_t i;
 
-	if (!mqtt_data.connected) {
-		return -ENOTCONN;
-	}
-
-	rc = snprintf(topic_buf, sizeof(topic_buf), "bluetooth/%s/connected", addr);
-	if (rc < 0 || (size_t)rc >= sizeof(topic_buf)) {
-		return -ENOMEM;
+	for (i = 0; i < ARRAY_SIZE(inflight); i++) {
+		if (inflight[i].state != INFLIGHT_FREE) {
+			pending++;
+		}
 	}
 
-	if (sizeof(topic_buf) < 2) {
-		return -ENOMEM;
+	shell_print(shell,
+		    "publishes in flight: %zu, acked: %u, retransmitted: %u, expired: %u",
+		    pending,
+		    inflight_stats.acked,
+		    inflight_stats.retransmitted,
+		    inflight_stats.expired);
+
+	if (inflight_stats.acked) {
+		shell_print(shell,
+			    "ack latency min/avg/max: %u/%u/%u ms",
+			    inflight_stats.latency_min,
+			    (uint32_t)(inflight_stats.latency_sum / inflight_stats.acked),
+			    inflight_stats.latency_max);
 	}
-
-	publish_data_buf[0] = '0';
-	publish_data_buf[1] = connected ? '1' : '0';
-
-	param.message.topic.qos = MQTT_QOS_1_AT_LEAST_ONCE;
-	param.message.topic.topic.utf8 = (uint8_t *)topic_buf;
-	param.message.topic.topic.size = (size_t)rc;
-	param.message.payload.data = publish_data_buf;
-	param.message.payload.len = 2;
-	param.message_id = sys_rand32_get();
-	param.dup_flag = 0U;
-	param.retain_flag = 1U;
-
-	return mqtt_publish(&mqtt_data.client_ctx, &param);
 }
+#endif
@@ -0,0 +1,491 @@
+#include <bluetooth/bluetooth.h>
+#include <settings/settings.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/util.h>
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
+
+#include "main.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(main_peer, LOG_LEVEL_DBG);
+
+#define PEER_SETTINGS_ROOT "central/peer"
+/* address type and address, hex encoded */
+#define PEER_ADDR_HEX_LEN (sizeof(bt_addr_le_t) * 2)
+#define PEER_SETTINGS_KEY_LEN (sizeof(PEER_SETTINGS_ROOT "/") + PEER_ADDR_HEX_LEN + sizeof("/gatt"))
+/* due devices seen advertising within this long compete for a poll slot */
+#define POLL_SEEN_WINDOW_MS 1000
+
+static struct main_peer peers[CONFIG_BT_MAX_PAIRED];
+/* the shell thread changes peers while the BT thread allocates them */
+static struct k_spinlock peer_lock;
+
+/* intervals in units of 1.25 ms, supervision timeout in units of 10 ms */
+static const struct {
+	const char *name;
+	struct bt_le_conn_param param;
+} conn_profiles[] = {
+	{ "default",
+	  BT_LE_CONN_PARAM_INIT(BT_GAP_INIT_CONN_INT_MIN, BT_GAP_INIT_CONN_INT_MAX, 0, 400) },
+	// quick response to commands at the cost of radio time
+	{ "fast", BT_LE_CONN_PARAM_INIT(12, 24, 0, 400) },
+	// sensors which report every few seconds
+	{ "lowpower", BT_LE_CONN_PARAM_INIT(400, 800, 4, 2000) },
+};
+
+static int peer_settings_key(const bt_addr_le_t *addr, const char *name, char *buf, size_t bufsize)
+{
+	char addr_hex[PEER_ADDR_HEX_LEN + 1];
+	int rc;
+
+	bin2hex((const uint8_t *)addr, sizeof(*addr), addr_hex, sizeof(addr_hex));
+
+	rc = snprintf(buf, bufsize, PEER_SETTINGS_ROOT "/%s/%s", addr_hex, name);
+	if (rc < 0 || (size_t)rc >= bufsize) {
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+struct main_peer *main_peer_find(const bt_addr_le_t *addr)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(peers); i++) {
+		if (peers[i].used && !bt_addr_le_cmp(&peers[i].addr, addr)) {
+			return &peers[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* with peer_lock held */
+static struct main_peer *peer_get(const bt_addr_le_t *addr)
+{
+	struct main_peer *peer;
+	size_t i;
+
+	peer = main_peer_find(addr);
+	if (peer) {
+		return peer;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(peers); i++) {
+		if (!peers[i].used) {
+			peer = &peers[i];
+
+			memset(peer, 0, sizeof(*peer));
+			peer->used = true;
+			bt_addr_le_copy(&peer->addr, addr);
+
+			return peer;
+		}
+	}
+
+	return NULL;
+}
+
+struct main_peer *main_peer_get(const bt_addr_le_t *addr)
+{
+	k_spinlock_key_t key = k_spin_lock(&peer_lock);
+	struct main_peer *peer = peer_get(addr);
+
+	k_spin_unlock(&peer_lock, key);
+
+	return peer;
+}
+
+static void peer_remove(struct main_peer *peer)
+{
+	char key[PEER_SETTINGS_KEY_LEN];
+	char addr[BT_ADDR_LE_STR_LEN];
+	k_spinlock_key_t lock_key;
+	int err;
+
+	bt_addr_le_to_str(&peer->addr, addr, sizeof(addr));
+	LOG_INF("forgetting %s", log_strdup(addr));
+
+	if (IS_ENABLED(CONFIG_CENTRAL_GATT_CACHE) &&
+	    !peer_settings_key(&peer->addr, "gatt", key, sizeof(key))) {
+		err = settings_delete(key);
+		if (err) {
+			LOG_ERR("failed to delete %s: %d", log_strdup(key), err);
+		}
+	}
+
+	if (peer->conn_param_valid && !peer_settings_key(&peer->addr, "conn", key, sizeof(key))) {
+		err = settings_delete(key);
+		if (err) {
+			LOG_ERR("failed to delete %s: %d", log_strdup(key), err);
+		}
+	}
+
+	if (peer->polled && !peer_settings_key(&peer->addr, "poll", key, sizeof(key))) {
+		err = settings_delete(key);
+		if (err) {
+			LOG_ERR("failed to delete %s: %d", log_strdup(key), err);
+		}
+	}
+
+	lock_key = k_spin_lock(&peer_lock);
+	memset(peer, 0, sizeof(*peer));
+	k_spin_unlock(&peer_lock, lock_key);
+}
+
+int main_peer_store_gatt(const struct main_peer *peer)
+{
+	char key[PEER_SETTINGS_KEY_LEN];
+	int err;
+
+	err = peer_settings_key(&peer->addr, "gatt", key, sizeof(key));
+	if (err) {
+		return err;
+	}
+
+	return settings_save_one(key,
+				 &peer->gatt,
+				 offsetof(struct main_gatt_cache, chrcs) +
+					 peer->gatt.num_chrcs * sizeof(peer->gatt.chrcs[0]));
+}
+
+int main_peer_conn_profile(const char *name, struct bt_le_conn_param *param)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(conn_profiles); i++) {
+		if (!strcmp(conn_profiles[i].name, name)) {
+			*param = conn_profiles[i].param;
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+const struct bt_le_conn_param *main_peer_conn_param(const struct main_peer *peer)
+{
+	if (peer && peer->conn_param_valid) {
+		return &peer->conn_param;
+	}
+
+	return &conn_profiles[0].param;
+}
+
+/* the limits of the core spec, the controller would reject anything else */
+static bool conn_param_valid(const struct bt_le_conn_param *param)
+{
+	if (param->interval_min < 6 || param->interval_max > 3200 ||
+	    param->interval_min > param->interval_max) {
+		return false;
+	}
+
+	if (param->latency > 499 || param->timeout < 10 || param->timeout > 3200) {
+		return false;
+	}
+
+	// the timeout has to cover two intervals the peripheral may skip
+	return (uint32_t)param->timeout * 4 > ((uint32_t)1 + param->latency) * param->interval_max;
+}
+
+int main_peer_set_conn_param(const bt_addr_le_t *addr, const struct bt_le_conn_param *param)
+{
+	char key[PEER_SETTINGS_KEY_LEN];
+	struct main_peer *peer;
+	k_spinlock_key_t lock_key;
+	int err;
+
+	if (!conn_param_valid(param)) {
+		return -EINVAL;
+	}
+
+	lock_key = k_spin_lock(&peer_lock);
+	peer = peer_get(addr);
+	if (peer) {
+		peer->conn_param = *param;
+		peer->conn_param_valid = true;
+	}
+	k_spin_unlock(&peer_lock, lock_key);
+
+	if (!peer) {
+		return -ENOMEM;
+	}
+
+	err = peer_settings_key(addr, "conn", key, sizeof(key));
+	if (err) {
+		return err;
+	}
+
+	err = settings_save_one(key, param, sizeof(*param));
+	if (err) {
+		return err;
+	}
+
+	return main_bt_update_conn_param(addr);
+}
+
+int main_peer_set_polled(const bt_addr_le_t *addr, bool polled)
+{
+	char key[PEER_SETTINGS_KEY_LEN];
+	struct main_peer *peer;
+	k_spinlock_key_t lock_key;
+	uint8_t val = polled;
+	int err;
+
+	lock_key = k_spin_lock(&peer_lock);
+	peer = peer_get(addr);
+	if (peer) {
+		peer->polled = polled;
+		// due right away, so the device shows up soon
+		peer->poll_due = 0;
+	}
+	k_spin_unlock(&peer_lock, lock_key);
+
+	if (!peer) {
+		return -ENOMEM;
+	}
+
+	err = peer_settings_key(addr, "poll", key, sizeof(key));
+	if (err) {
+		return err;
+	}
+
+	return polled ? settings_save_one(key, &val, sizeof(val)) : settings_delete(key);
+}
+
+size_t main_peer_num_polled(void)
+{
+	size_t num = 0;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(peers); i++) {
+		if (peers[i].used && peers[i].polled) {
+			num++;
+		}
+	}
+
+	return num;
+}
+
+size_t main_peer_num_broadcasting(void)
+{
+	size_t num = 0;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(peers); i++) {
+		if (peers[i].used && peers[i].broadcast) {
+			num++;
+		}
+	}
+
+	return num;
+}
+
+/* polled devices waiting for their turn, next_due is when the next one will be */
+size_t main_peer_num_due(int64_t now, int64_t *next_due)
+{
+	size_t num = 0;
+	size_t i;
+
+	*next_due = INT64_MAX;
+
+	for (i = 0; i < ARRAY_SIZE(peers); i++) {
+		if (!peers[i].used || !peers[i].polled) {
+			continue;
+		}
+
+		if (peers[i].poll_due <= now) {
+			num++;
+		} else {
+			*next_due = MIN(*next_due, peers[i].poll_due);
+		}
+	}
+
+	return num;
+}
+
+/*
+ * Of the due devices which are advertising right now, the one waiting longest
+ * for its turn. One which wasn't seen lately doesn't hold up the others.
+ */
+const struct main_peer *main_peer_next_poll(int64_t now)
+{
+	const struct main_peer *next = NULL;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(peers); i++) {
+		if (!peers[i].used || !peers[i].polled || peers[i].poll_due > now ||
+		    now - peers[i].poll_seen > POLL_SEEN_WINDOW_MS ||
+		    now < peers[i].next_connect || main_bt_is_connecting(&peers[i].addr)) {
+			continue;
+		}
+
+		if (!next || peers[i].poll_due < next->poll_due) {
+			next = &peers[i];
+		}
+	}
+
+	return next;
+}
+
+void main_peer_sync_bonds(void)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(peers); i++) {
+		if (peers[i].used && !main_bt_is_bonded(&peers[i].addr)) {
+			peer_remove(&peers[i]);
+		}
+	}
+}
+
+static int peer_settings_set_gatt(struct main_peer *peer,
+				  size_t len,
+				  settings_read_cb read_cb,
+				  void *cb_arg)
+{
+	ssize_t rc;
+
+	if (len < offsetof(struct main_gatt_cache, chrcs) || len > sizeof(peer->gatt)) {
+		return -EINVAL;
+	}
+
+	rc = read_cb(cb_arg, &peer->gatt, len);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if ((size_t)rc != len || peer->gatt.num_chrcs > ARRAY_SIZE(peer->gatt.chrcs) ||
+	    len != offsetof(struct main_gatt_cache, chrcs) +
+			    peer->gatt.num_chrcs * sizeof(peer->gatt.chrcs[0])) {
+		LOG_ERR("invalid gatt cache");
+		peer->gatt.num_chrcs = 0;
+		return -EINVAL;
+	}
+
+	peer->gatt_valid = true;
+
+	return 0;
+}
+
+static int peer_settings_set_conn(struct main_peer *peer,
+				  size_t len,
+				  settings_read_cb read_cb,
+				  void *cb_arg)
+{
+	ssize_t rc;
+
+	if (len != sizeof(peer->conn_param)) {
+		return -EINVAL;
+	}
+
+	rc = read_cb(cb_arg, &peer->conn_param, len);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if ((size_t)rc != len || !conn_param_valid(&peer->conn_param)) {
+		LOG_ERR("invalid connection parameters");
+		return -EINVAL;
+	}
+
+	peer->conn_param_valid = true;
+
+	return 0;
+}
+
+static int peer_settings_set_poll(struct main_peer *peer,
+				  size_t len,
+				  settings_read_cb read_cb,
+				  void *cb_arg)
+{
+	uint8_t val;
+	ssize_t rc;
+
+	if (len != sizeof(val)) {
+		return -EINVAL;
+	}
+
+	rc = read_cb(cb_arg, &val, len);
+	if (rc < 0) {
+		return rc;
+	}
+
+	peer->polled = val;
+
+	return 0;
+}
+
+static int peer_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+	bt_addr_le_t addr;
+	struct main_peer *peer;
+	const char *next;
+
+	if (settings_name_next(name, &next) != PEER_ADDR_HEX_LEN || !next) {
+		return -ENOENT;
+	}
+
+	if (hex2bin(name, PEER_ADDR_HEX_LEN, (uint8_t *)&addr, sizeof(addr)) != sizeof(addr)) {
+		return -EINVAL;
+	}
+
+	peer = main_peer_get(&addr);
+	if (!peer) {
+		LOG_ERR("no space for stored peer");
+		return -ENOMEM;
+	}
+
+	if (IS_ENABLED(CONFIG_CENTRAL_GATT_CACHE) && settings_name_steq(next, "gatt", NULL)) {
+		return peer_settings_set_gatt(peer, len, read_cb, cb_arg);
+	}
+
+	if (settings_name_steq(next, "conn", NULL)) {
+		return peer_settings_set_conn(peer, len, read_cb, cb_arg);
+	}
+
+	if (settings_name_steq(next, "poll", NULL)) {
+		return peer_settings_set_poll(peer, len, read_cb, cb_arg);
+	}
+
+	return -ENOENT;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(
+	central_peer, PEER_SETTINGS_ROOT, NULL, peer_settings_set, NULL, NULL);
+
+#ifdef CONFIG_SHELL
+/* how far every polled device lags behind its schedule */
+void main_peer_print_poll_stats(const struct shell *shell)
+{
+	char addr[BT_ADDR_LE_STR_LEN];
+	int64_t now = k_uptime_get();
+	const struct main_peer *peer;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(peers); i++) {
+		peer = &peers[i];
+		if (!peer->used || !peer->polled) {
+			continue;
+		}
+
+		bt_addr_le_to_str(&peer->addr, addr, sizeof(addr));
+		if (!peer->polls) {
+			shell_print(shell, "%s: polled, not served yet", addr);
+			continue;
+		}
+
+		shell_print(shell,
+			    "%s: polled %u times, data age %lld s, late last %lld s, max %lld s",
+			    addr,
+			    peer->polls,
+			    (now - peer->last_poll) / MSEC_PER_SEC,
+			    peer->poll_lag_last / MSEC_PER_SEC,
+			    peer->poll_lag_max / MSEC_PER_SEC);
+	}
+}
+#endif
@@ -0,0 +1,114 @@
+#include <sys/util.h>
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
+
+#include "main.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(main_state, LOG_LEVEL_DBG);
+
+/*
+ * The last value published for every device and handle, so unchanged values
+ * aren't published again and the broker can be brought up to date after
+ * reconnecting. Only used by the MQTT thread.
+ */
+struct state_entry {
+	/* uptime of the last publish, 0 if unused */
+	int64_t time;
+	struct main_event evt;
+};
+
+static struct state_entry entries[CONFIG_CENTRAL_STATE_SIZE];
+
+static uint32_t stat_suppressed;
+
+static bool entry_matches(const struct state_entry *entry, const struct main_event *evt)
+{
+	return entry->time && entry->evt.handle == evt->handle &&
+	       !bt_addr_cmp(&entry->evt.addr, &evt->addr);
+}
+
+static struct state_entry *entry_find(const struct main_event *evt)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(entries); i++) {
+		if (entry_matches(&entries[i], evt)) {
+			return &entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The same value got published within CONFIG_CENTRAL_STATE_DEDUP_WINDOW.
+ * Answers to reads are never duplicates, someone is waiting for them.
+ */
+bool main_state_is_duplicate(const struct main_event *evt)
+{
+	const struct state_entry *entry = entry_find(evt);
+
+	if (evt->solicited || !entry || entry->evt.len != evt->len ||
+	    memcmp(entry->evt.data, evt->data, evt->len) ||
+	    k_uptime_get() - entry->time >= CONFIG_CENTRAL_STATE_DEDUP_WINDOW * MSEC_PER_SEC) {
+		return false;
+	}
+
+	stat_suppressed++;
+	return true;
+}
+
+/* the least recently published entry makes room for new handles */
+void main_state_update(const struct main_event *evt)
+{
+	struct state_entry *entry = entry_find(evt);
+	size_t i;
+
+	if (!entry) {
+		entry = &entries[0];
+		for (i = 1; i < ARRAY_SIZE(entries) && entry->time; i++) {
+			if (!entries[i].time || entries[i].time < entry->time) {
+				entry = &entries[i];
+			}
+		}
+	}
+
+	entry->time = k_uptime_get();
+	entry->evt = *evt;
+}
+
+/* walk through all values, returns false after the last one */
+bool main_state_get(size_t *pos, struct main_event *evt)
+{
+	while (*pos < ARRAY_SIZE(entries)) {
+		const struct state_entry *entry = &entries[(*pos)++];
+
+		if (entry->time) {
+			*evt = entry->evt;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+#ifdef CONFIG_SHELL
+void main_state_print_stats(const struct shell *shell)
+{
+	size_t used = 0;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(entries); i++) {
+		if (entries[i].time) {
+			used++;
+		}
+	}
+
+	shell_print(shell,
+		    "published values known: %zu, unchanged ones suppressed: %u",
+		    used,
+		    stat_suppressed);
+}
+#endif
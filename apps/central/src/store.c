@@ -0,0 +1,251 @@
+#include <sys/util.h>
+#ifdef CONFIG_CENTRAL_STORE_FLASH
+#include <drivers/flash.h>
+#include <fs/nvs.h>
+#include <storage/flash_map.h>
+#endif
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
+
+#include "main.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(main_store, LOG_LEVEL_DBG);
+
+/*
+ * Characteristic values which couldn't be published because the broker was
+ * unreachable. Only used by the MQTT thread.
+ * With CONFIG_CENTRAL_STORE_FLASH the oldest events move to flash when RAM
+ * is full, so flash always holds older events than RAM.
+ */
+static struct main_event ram[CONFIG_CENTRAL_STORE_SIZE];
+static uint32_t ram_head;
+static uint32_t ram_tail;
+
+static uint32_t stat_stored;
+static uint32_t stat_dropped;
+static uint32_t stat_expired;
+static uint32_t stat_replayed;
+static uint32_t stat_high_water;
+
+#ifdef CONFIG_CENTRAL_STORE_FLASH
+static struct nvs_fs fs;
+static bool fs_ready;
+static uint32_t flash_head;
+static uint32_t flash_tail;
+
+/* NVS ids start at 1, slots are reused round robin */
+static uint16_t flash_id(uint32_t pos)
+{
+	return 1 + pos % CONFIG_CENTRAL_STORE_FLASH_SIZE;
+}
+
+static void flash_put(const struct main_event *evt)
+{
+	ssize_t rc;
+
+	if (flash_head - flash_tail >= CONFIG_CENTRAL_STORE_FLASH_SIZE) {
+		flash_tail++;
+		stat_dropped++;
+	}
+
+	rc = nvs_write(&fs, flash_id(flash_head), evt, sizeof(*evt));
+	if (rc < 0) {
+		LOG_ERR("failed to spill event to flash: %d", rc);
+		stat_dropped++;
+		return;
+	}
+
+	flash_head++;
+}
+
+static bool flash_peek(struct main_event *evt)
+{
+	ssize_t rc;
+
+	while (flash_head != flash_tail) {
+		rc = nvs_read(&fs, flash_id(flash_tail), evt, sizeof(*evt));
+		if (rc == sizeof(*evt)) {
+			return true;
+		}
+
+		LOG_ERR("failed to read event from flash: %d", rc);
+		flash_tail++;
+		stat_dropped++;
+	}
+
+	return false;
+}
+
+static int flash_init(void)
+{
+	const struct flash_area *fa;
+	const struct device *dev;
+	struct flash_pages_info info;
+	int err;
+
+	err = flash_area_open(FLASH_AREA_ID(event_store), &fa);
+	if (err) {
+		return err;
+	}
+
+	dev = device_get_binding(fa->fa_dev_name);
+	if (!dev) {
+		err = -ENODEV;
+		goto close;
+	}
+
+	err = flash_get_page_info_by_offs(dev, fa->fa_off, &info);
+	if (err) {
+		goto close;
+	}
+
+	fs.offset = fa->fa_off;
+	fs.sector_size = info.size;
+	fs.sector_count = fa->fa_size / info.size;
+
+	err = nvs_init(&fs, fa->fa_dev_name);
+	if (err) {
+		goto close;
+	}
+
+	// the positions are lost on reboot, so are the events
+	err = nvs_clear(&fs);
+	if (err) {
+		goto close;
+	}
+
+	err = nvs_init(&fs, fa->fa_dev_name);
+
+close:
+	flash_area_close(fa);
+	return err;
+}
+#endif
+
+static size_t stored_count(void)
+{
+	size_t count = ram_head - ram_tail;
+
+#ifdef CONFIG_CENTRAL_STORE_FLASH
+	count += flash_head - flash_tail;
+#endif
+
+	return count;
+}
+
+bool main_store_empty(void)
+{
+	return stored_count() == 0;
+}
+
+void main_store_put(const struct main_event *evt)
+{
+	if (ram_head - ram_tail >= ARRAY_SIZE(ram)) {
+#ifdef CONFIG_CENTRAL_STORE_FLASH
+		if (fs_ready) {
+			flash_put(&ram[ram_tail % ARRAY_SIZE(ram)]);
+		} else {
+			stat_dropped++;
+		}
+#else
+		stat_dropped++;
+#endif
+		ram_tail++;
+	}
+
+	ram[ram_head++ % ARRAY_SIZE(ram)] = *evt;
+
+	stat_stored++;
+	stat_high_water = MAX(stat_high_water, stored_count());
+}
+
+static bool store_peek(struct main_event *evt)
+{
+#ifdef CONFIG_CENTRAL_STORE_FLASH
+	if (flash_peek(evt)) {
+		return true;
+	}
+#endif
+
+	if (ram_head == ram_tail) {
+		return false;
+	}
+
+	*evt = ram[ram_tail % ARRAY_SIZE(ram)];
+	return true;
+}
+
+static void store_drop(void)
+{
+#ifdef CONFIG_CENTRAL_STORE_FLASH
+	if (flash_head != flash_tail) {
+		flash_tail++;
+		return;
+	}
+#endif
+
+	if (ram_head != ram_tail) {
+		ram_tail++;
+	}
+}
+
+/*
+ * Returns the oldest event which isn't too old to be worth publishing. It
+ * stays stored until main_store_pop(), so it isn't lost if publishing fails.
+ */
+bool main_store_peek(struct main_event *evt)
+{
+	while (store_peek(evt)) {
+		if (CONFIG_CENTRAL_STORE_MAX_AGE &&
+		    k_uptime_get_32() - evt->timestamp >
+			    CONFIG_CENTRAL_STORE_MAX_AGE * MSEC_PER_SEC) {
+			store_drop();
+			stat_expired++;
+			continue;
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+/* removes the event returned by main_store_peek() */
+void main_store_pop(void)
+{
+	store_drop();
+	stat_replayed++;
+}
+
+void main_store_init(void)
+{
+#ifdef CONFIG_CENTRAL_STORE_FLASH
+	int err;
+
+	err = flash_init();
+	if (err) {
+		LOG_ERR("failed to init event store in flash: %d", err);
+		return;
+	}
+
+	fs_ready = true;
+#endif
+}
+
+#ifdef CONFIG_SHELL
+void main_store_print_stats(const struct shell *shell)
+{
+	shell_print(shell,
+		    "offline events stored: %zu, high water: %u",
+		    stored_count(),
+		    stat_high_water);
+	shell_print(shell,
+		    "offline events total: %u, replayed: %u, expired: %u, dropped: %u",
+		    stat_stored,
+		    stat_replayed,
+		    stat_expired,
+		    stat_dropped);
+}
+#endif
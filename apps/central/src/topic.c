@@ -0,0 +1,183 @@
+#include <bluetooth/addr.h>
+#include <net/mqtt.h>
+#include <sys/byteorder.h>
+#include <sys/util.h>
+
+#include "main.h"
+
+#include <logging/log.h>
+LOG_MODULE_REGISTER(main_topic, LOG_LEVEL_DBG);
+
+#define TOPIC_MAX_SEGMENTS 8
+
+#define PLACEHOLDER_MAC "{mac}"
+#define PLACEHOLDER_HANDLE "{handle}"
+
+/* views into the topic, nothing gets copied */
+struct topic_tokens {
+	struct mqtt_utf8 segments[TOPIC_MAX_SEGMENTS];
+	size_t count;
+};
+
+static int topic_tokenize(const struct mqtt_utf8 *topic, struct topic_tokens *tokens)
+{
+	const uint8_t *start = topic->utf8;
+	const uint8_t *end = topic->utf8 + topic->size;
+	const uint8_t *pos;
+
+	tokens->count = 0;
+
+	for (pos = start; pos <= end; pos++) {
+		if (pos != end && *pos != '/') {
+			continue;
+		}
+
+		if (tokens->count == ARRAY_SIZE(tokens->segments)) {
+			return -ENOMEM;
+		}
+
+		tokens->segments[tokens->count].utf8 = start;
+		tokens->segments[tokens->count].size = pos - start;
+		tokens->count++;
+
+		start = pos + 1;
+	}
+
+	return 0;
+}
+
+static bool segment_eq(const struct mqtt_utf8 *segment, const char *str, size_t len)
+{
+	return segment->size == len && !memcmp(segment->utf8, str, len);
+}
+
+/* XX:XX:XX:XX:XX:XX, most significant byte first like bt_addr_to_str() */
+static int parse_addr(const struct mqtt_utf8 *segment, bt_addr_t *addr)
+{
+	const char *str = (const char *)segment->utf8;
+	size_t i;
+
+	if (segment->size != BT_ADDR_STR_LEN - 1) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(addr->val); i++) {
+		if (i > 0 && str[i * 3 - 1] != ':') {
+			return -EINVAL;
+		}
+
+		if (hex2bin(&str[i * 3], 2, &addr->val[ARRAY_SIZE(addr->val) - 1 - i], 1) != 1) {
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/* always 4 hex digits */
+static int parse_handle(const struct mqtt_utf8 *segment, uint16_t *handle)
+{
+	uint8_t buf[2];
+
+	if (segment->size != sizeof(buf) * 2) {
+		return -EINVAL;
+	}
+
+	if (hex2bin((const char *)segment->utf8, segment->size, buf, sizeof(buf)) != sizeof(buf)) {
+		return -EINVAL;
+	}
+
+	*handle = sys_get_be16(buf);
+
+	return *handle ? 0 : -EINVAL;
+}
+
+static bool route_match(const struct main_topic_route *route,
+			const struct topic_tokens *tokens,
+			struct main_topic_args *args)
+{
+	const char *pattern = route->pattern;
+	const char *end;
+	size_t len;
+	size_t i;
+
+	for (i = 0; i < tokens->count; i++) {
+		const struct mqtt_utf8 *segment = &tokens->segments[i];
+
+		end = strchr(pattern, '/');
+		len = end ? (size_t)(end - pattern) : strlen(pattern);
+
+		if (len == strlen(PLACEHOLDER_MAC) && !strncmp(pattern, PLACEHOLDER_MAC, len)) {
+			if (parse_addr(segment, &args->addr)) {
+				return false;
+			}
+		} else if (len == strlen(PLACEHOLDER_HANDLE) &&
+			   !strncmp(pattern, PLACEHOLDER_HANDLE, len)) {
+			if (parse_handle(segment, &args->handle)) {
+				return false;
+			}
+		} else if (!segment_eq(segment, pattern, len)) {
+			return false;
+		}
+
+		if (!end) {
+			return i + 1 == tokens->count;
+		}
+
+		pattern = end + 1;
+	}
+
+	return false;
+}
+
+const struct main_topic_route *main_topic_route(const struct main_topic_route *routes,
+						size_t num_routes,
+						const struct mqtt_utf8 *topic,
+						struct main_topic_args *args)
+{
+	struct topic_tokens tokens;
+	size_t i;
+
+	if (topic_tokenize(topic, &tokens)) {
+		LOG_ERR("too many topic segments");
+		return NULL;
+	}
+
+	for (i = 0; i < num_routes; i++) {
+		if (route_match(&routes[i], &tokens, args)) {
+			return &routes[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* the subscription filter of a route, placeholders become single level wildcards */
+int main_topic_filter(const struct main_topic_route *route, char *buf, size_t bufsize)
+{
+	const char *pattern = route->pattern;
+	size_t len = 0;
+
+	while (*pattern) {
+		if (len + 1 >= bufsize) {
+			return -ENOMEM;
+		}
+
+		if (*pattern == '{') {
+			pattern = strchr(pattern, '}');
+			if (!pattern) {
+				return -EINVAL;
+			}
+
+			buf[len++] = '+';
+		} else {
+			buf[len++] = *pattern;
+		}
+
+		pattern++;
+	}
+
+	buf[len] = '\0';
+
+	return len;
+}
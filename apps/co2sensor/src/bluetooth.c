@@ -9,7 +9,9 @@
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/conn.h>
+#include <bluetooth/crypto.h>
 #include <bluetooth/gatt.h>
+#include <bluetooth/hci.h>
 #include <bluetooth/uuid.h>
 
 #include "main.h"
@@ -23,6 +25,232 @@ static const struct bt_data ad[] = {
 	BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
 };
 
+#ifdef CONFIG_SENSOR_BROADCAST
+/*
+ * Manufacturer specific data with the values, encrypted for the bonded
+ * central. See apps/central/src/broadcast.c for the format.
+ */
+#define BROADCAST_COMPANY_ID 0xffff
+#define BROADCAST_VERSION 1
+#define BROADCAST_HEADER_LEN 9
+#define BROADCAST_MIC_LEN 4
+#define BROADCAST_VALUES_MAX_LEN 32
+/* counters reserved in settings at a time, so flash isn't written for every broadcast */
+#define BROADCAST_COUNTER_BLOCK 1024
+
+static const uint8_t broadcast_key_label[16] = "btlr broadcast";
+/* random for every boot, so even a counter lost with the settings gives new nonces */
+static uint32_t broadcast_session;
+/* never goes back, the central drops broadcasts with a counter it saw already */
+static uint32_t broadcast_counter;
+/* stored in settings, broadcast_counter may go up to it before reserving more */
+static uint32_t broadcast_counter_limit;
+static uint8_t broadcast_buf[2 + BROADCAST_HEADER_LEN + BROADCAST_VALUES_MAX_LEN +
+			     BROADCAST_MIC_LEN];
+static struct bt_data broadcast_ad[] = {
+	BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
+	{ .type = BT_DATA_MANUFACTURER_DATA, .data = broadcast_buf },
+};
+static struct k_work_delayable broadcast_disconnect_worker;
+/* the counter must never be used twice */
+static K_MUTEX_DEFINE(broadcast_lock);
+
+static void bond_find_first(const struct bt_bond_info *info, void *user_data)
+{
+	bt_addr_le_t *addr = user_data;
+
+	if (!bt_addr_le_cmp(addr, BT_ADDR_LE_ANY)) {
+		bt_addr_le_copy(addr, &info->addr);
+	}
+}
+
+static int broadcast_settings_set(const char *name,
+				  size_t len,
+				  settings_read_cb read_cb,
+				  void *cb_arg)
+{
+	ssize_t rc;
+
+	if (!settings_name_steq(name, "counter", NULL)) {
+		return -ENOENT;
+	}
+
+	if (len != sizeof(broadcast_counter_limit)) {
+		return -EINVAL;
+	}
+
+	rc = read_cb(cb_arg, &broadcast_counter_limit, len);
+	if (rc < 0) {
+		return rc;
+	}
+
+	// counters used before the reboot are all below the reserved limit
+	broadcast_counter = broadcast_counter_limit;
+
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(
+	sensor_broadcast, "broadcast", NULL, broadcast_settings_set, NULL, NULL);
+
+static int broadcast_counter_next(void)
+{
+	uint32_t limit;
+	int err;
+
+	if (broadcast_counter >= broadcast_counter_limit) {
+		limit = broadcast_counter + BROADCAST_COUNTER_BLOCK;
+
+		err = settings_save_one("broadcast/counter", &limit, sizeof(limit));
+		if (err) {
+			return err;
+		}
+
+		broadcast_counter_limit = limit;
+	}
+
+	broadcast_counter++;
+
+	return 0;
+}
+
+static int broadcast_encode(void)
+{
+	bt_addr_le_t central;
+	uint8_t values[BROADCAST_VALUES_MAX_LEN];
+	uint8_t *header = &broadcast_buf[2];
+	uint8_t nonce[13] = { 0 };
+	uint8_t ltk[16];
+	uint8_t key[16];
+	int len;
+	int err;
+
+	bt_addr_le_copy(&central, BT_ADDR_LE_ANY);
+	bt_foreach_bond(BT_ID_DEFAULT, bond_find_first, &central);
+	if (!bt_addr_le_cmp(&central, BT_ADDR_LE_ANY)) {
+		return -ENOENT;
+	}
+
+	err = main_bt_bond_ltk(&central, ltk);
+	if (err) {
+		return err;
+	}
+
+	err = bt_encrypt_be(ltk, broadcast_key_label, key);
+	if (err) {
+		return err;
+	}
+
+	len = bt_co2_broadcast_values(values, sizeof(values));
+	if (len < 0) {
+		return len;
+	}
+
+	err = broadcast_counter_next();
+	if (err) {
+		return err;
+	}
+
+	sys_put_le16(BROADCAST_COMPANY_ID, broadcast_buf);
+	header[0] = BROADCAST_VERSION;
+	sys_put_le32(broadcast_session, &header[1]);
+	sys_put_le32(broadcast_counter, &header[5]);
+	memcpy(nonce, &header[1], 8);
+
+	err = bt_ccm_encrypt(key,
+			     nonce,
+			     values,
+			     len,
+			     header,
+			     BROADCAST_HEADER_LEN,
+			     &header[BROADCAST_HEADER_LEN],
+			     BROADCAST_MIC_LEN);
+	if (err) {
+		return err;
+	}
+
+	broadcast_ad[1].data_len = 2 + BROADCAST_HEADER_LEN + len + BROADCAST_MIC_LEN;
+
+	return 0;
+}
+
+static void broadcast_disconnect(struct bt_conn *conn, void *data)
+{
+	int err;
+
+	err = bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	if (err) {
+		printk("Failed to disconnect (err %d)\n", err);
+	}
+}
+
+/*
+ * Advertising restarts afterwards, with the values encrypted for the new bond.
+ * Without a key for that, e.g. for a legacy bond, the connection is kept.
+ */
+static void broadcast_disconnect_connections(struct k_work *item)
+{
+	int err;
+
+	k_mutex_lock(&broadcast_lock, K_FOREVER);
+	err = broadcast_encode();
+	if (!err) {
+		err = bt_le_ext_adv_set_data(adv, broadcast_ad, ARRAY_SIZE(broadcast_ad), NULL, 0);
+	}
+	k_mutex_unlock(&broadcast_lock);
+
+	if (err) {
+		printk("Can't broadcast for this bond (err %d), staying connected\n", err);
+		return;
+	}
+
+	bt_conn_foreach(BT_CONN_TYPE_LE, broadcast_disconnect, NULL);
+}
+
+/* the central got the keys, from now on it reads the advertisements */
+static void security_changed(struct bt_conn *conn, bt_security_t level, enum bt_security_err err)
+{
+	if (err || level < BT_SECURITY_L2) {
+		return;
+	}
+
+	k_work_schedule(&broadcast_disconnect_worker,
+			K_SECONDS(CONFIG_SENSOR_BROADCAST_DISCONNECT_DELAY));
+}
+#endif
+
+/* the encrypted values once bonded in broadcast mode, just the flags otherwise */
+static int set_advertising_data(void)
+{
+#ifdef CONFIG_SENSOR_BROADCAST
+	if (!broadcast_encode()) {
+		return bt_le_ext_adv_set_data(adv, broadcast_ad, ARRAY_SIZE(broadcast_ad), NULL, 0);
+	}
+#endif
+
+	return bt_le_ext_adv_set_data(adv, ad, ARRAY_SIZE(ad), NULL, 0);
+}
+
+void main_bt_values_changed(void)
+{
+	int err;
+
+	if (!IS_ENABLED(CONFIG_SENSOR_BROADCAST) || !adv) {
+		return;
+	}
+
+#ifdef CONFIG_SENSOR_BROADCAST
+	k_mutex_lock(&broadcast_lock, K_FOREVER);
+#endif
+	err = set_advertising_data();
+#ifdef CONFIG_SENSOR_BROADCAST
+	k_mutex_unlock(&broadcast_lock);
+#endif
+	if (err) {
+		printk("Failed to update advertising data (%d)\n", err);
+	}
+}
+
 static void connected(struct bt_conn *conn, uint8_t conn_err)
 {
 	int err;
@@ -60,6 +288,9 @@ static void disconnected(struct bt_conn *conn, uint8_t reason)
 static struct bt_conn_cb conn_callbacks = {
 	.connected = connected,
 	.disconnected = disconnected,
+#ifdef CONFIG_SENSOR_BROADCAST
+	.security_changed = security_changed,
+#endif
 };
 
 static int create_advertising_coded(void)
@@ -79,7 +310,7 @@ static int create_advertising_coded(void)
 
 	printk("Created adv: %p\n", adv);
 
-	err = bt_le_ext_adv_set_data(adv, ad, ARRAY_SIZE(ad), NULL, 0);
+	err = set_advertising_data();
 	if (err) {
 		printk("Failed to set advertising data (%d)\n", err);
 		return err;
@@ -116,6 +347,15 @@ static void bt_ready(void)
 	}
 
 	k_work_init_delayable(&start_advertising_worker, start_advertising_coded);
+#ifdef CONFIG_SENSOR_BROADCAST
+	k_work_init_delayable(&broadcast_disconnect_worker, broadcast_disconnect_connections);
+	// a repeated session would reuse nonces
+	err = bt_rand(&broadcast_session, sizeof(broadcast_session));
+	if (err) {
+		printk("Failed to get a broadcast session (err %d)\n", err);
+		return;
+	}
+#endif
 
 	err = create_advertising_coded();
 	if (err) {
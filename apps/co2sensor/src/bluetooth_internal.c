@@ -0,0 +1,24 @@
+#include <bluetooth/addr.h>
+#include <bluetooth/bluetooth.h>
+#include <string.h>
+
+#include "keys.h"
+#include "main.h"
+
+/*
+ * Only LE secure connections give both sides the same LTK. The apps are built
+ * separately and share no sources, so apps/central has a copy of this, keep
+ * them the same.
+ */
+int main_bt_bond_ltk(const bt_addr_le_t *addr, uint8_t ltk[16])
+{
+	struct bt_keys *keys = bt_keys_find(BT_KEYS_LTK_P256, BT_ID_DEFAULT, addr);
+
+	if (!keys) {
+		return -ENOENT;
+	}
+
+	memcpy(ltk, keys->ltk.val, sizeof(keys->ltk.val));
+
+	return 0;
+}
@@ -162,3 +162,31 @@ int bt_co2_spaceco2_notify(uint16_t val)
 
 	return rc == -ENOTCONN ? 0 : rc;
 }
+
+/* handle, length and value of every characteristic, for the broadcast mode */
+int bt_co2_broadcast_values(uint8_t *buf, size_t bufsize)
+{
+	// the characteristic declarations, like for notifying
+	static const uint8_t attrs[] = { 1, 4, 7, 10 };
+	const uint16_t values[] = {
+		g_main_meterstatus,
+		g_main_alarmstatus,
+		g_main_outputstatus,
+		g_main_spaceco2,
+	};
+	size_t len = 0;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(attrs); i++) {
+		if (len + 5 > bufsize) {
+			return -ENOMEM;
+		}
+
+		sys_put_le16(bt_gatt_attr_value_handle(&dehumid_svc.attrs[attrs[i]]), &buf[len]);
+		buf[len + 2] = sizeof(values[i]);
+		sys_put_le16(values[i], &buf[len + 3]);
+		len += 5;
+	}
+
+	return len;
+}
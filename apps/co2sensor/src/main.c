@@ -125,6 +125,7 @@ void main(void)
 		uint16_t alarmstatus = regs[1];
 		uint16_t outputstatus = regs[2];
 		uint16_t spaceco2 = regs[3];
+		bool changed = false;
 
 		LOG_INF("meter=0x%04x alarm=0x%04x output=0x%04x co2=%u",
 			meterstatus,
@@ -135,18 +136,26 @@ void main(void)
 		if (g_main_meterstatus != meterstatus) {
 			g_main_meterstatus = meterstatus;
 			bt_co2_meterstatus_notify(meterstatus);
+			changed = true;
 		}
 		if (g_main_alarmstatus != alarmstatus) {
 			g_main_alarmstatus = alarmstatus;
 			bt_co2_alarmstatus_notify(alarmstatus);
+			changed = true;
 		}
 		if (g_main_outputstatus != outputstatus) {
 			g_main_outputstatus = outputstatus;
 			bt_co2_outputstatus_notify(outputstatus);
+			changed = true;
 		}
 		if (g_main_spaceco2 != spaceco2) {
 			g_main_spaceco2 = spaceco2;
 			bt_co2_spaceco2_notify(spaceco2);
+			changed = true;
+		}
+
+		if (changed) {
+			main_bt_values_changed();
 		}
 	}
 }
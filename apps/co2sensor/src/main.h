@@ -1,6 +1,8 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+#include <bluetooth/addr.h>
+#include <stddef.h>
 #include <stdint.h>
 
 extern uint16_t g_main_meterstatus;
@@ -9,6 +11,9 @@ extern uint16_t g_main_outputstatus;
 extern uint16_t g_main_spaceco2;
 
 void main_init_bluetooth(void);
+void main_bt_values_changed(void);
+int main_bt_bond_ltk(const bt_addr_le_t *addr, uint8_t ltk[16]);
+int bt_co2_broadcast_values(uint8_t *buf, size_t bufsize);
 int bt_co2_meterstatus_notify(uint16_t val);
 int bt_co2_alarmstatus_notify(uint16_t val);
 int bt_co2_outputstatus_notify(uint16_t val);
@@ -185,7 +185,8 @@ BT_GATT_SERVICE_DEFINE(
 	BT_GATT_PRIMARY_SERVICE(BT_UUID_DEHUMID),
 
 	BT_GATT_CHARACTERISTIC(BT_UUID_DEHUMID_IONIZER,
-			       BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE | BT_GATT_CHRC_NOTIFY,
+			       BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE |
+				       BT_GATT_CHRC_WRITE_WITHOUT_RESP | BT_GATT_CHRC_NOTIFY,
 			       BT_GATT_PERM_READ_ENCRYPT | BT_GATT_PERM_WRITE_ENCRYPT,
 			       ionizer_read,
 			       ionizer_write,
@@ -193,7 +194,8 @@ BT_GATT_SERVICE_DEFINE(
 	BT_GATT_CCC(NULL, BT_GATT_PERM_READ_ENCRYPT | BT_GATT_PERM_WRITE_ENCRYPT),
 
 	BT_GATT_CHARACTERISTIC(BT_UUID_DEHUMID_FAN,
-			       BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE | BT_GATT_CHRC_NOTIFY,
+			       BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE |
+				       BT_GATT_CHRC_WRITE_WITHOUT_RESP | BT_GATT_CHRC_NOTIFY,
 			       BT_GATT_PERM_READ_ENCRYPT | BT_GATT_PERM_WRITE_ENCRYPT,
 			       fan_read,
 			       fan_write,